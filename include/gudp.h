@@ -8,6 +8,10 @@
 
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #include <gimxpoll/include/gpoll.h>
 
 enum gudp_mode {
@@ -38,6 +42,128 @@ typedef struct {
  */
 struct gudp_socket;
 
+enum gudp_pacing_offload {
+    GUDP_PACING_OFFLOAD_NONE,   // packets are held in a user-space release queue
+    GUDP_PACING_OFFLOAD_TXTIME, // release times are handed to the kernel (SO_TXTIME)
+    GUDP_PACING_OFFLOAD_RATE,   // the socket rate is enforced by the kernel (SO_MAX_PACING_RATE)
+};
+
+struct gudp_pacing {
+    uint64_t rate;       // target rate in bytes per second, 0 disables pacing
+    unsigned int burst;  // token bucket depth in bytes
+    enum gudp_pacing_offload offload; // kernel pacing to use (socket-wide setting only)
+};
+
+struct gudp_pacing_stats {
+    uint64_t target_rate; // configured rate, in bytes per second
+    uint64_t actual_rate; // measured rate, in bytes per second
+    uint64_t packets;     // number of packets sent
+    uint64_t bytes;       // number of bytes sent
+    uint64_t last_delay;  // pacing delay added to the last packet, in nanoseconds
+    uint64_t max_delay;   // maximum pacing delay, in nanoseconds
+    uint64_t total_delay; // sum of pacing delays, in nanoseconds
+    enum gudp_pacing_offload offload;
+};
+
+enum gudp_direction {
+    GUDP_DIRECTION_IN,
+    GUDP_DIRECTION_OUT,
+};
+
+/*
+ * \brief A captured packet.
+ */
+struct gudp_capture_record {
+    uint32_t length;     // record length, including this header and padding
+    uint32_t count;      // payload length
+    uint64_t timestamp;  // capture time, in nanoseconds
+    uint32_t ip;         // peer address
+    uint16_t port;
+    uint8_t direction;   // see enum gudp_direction
+    uint8_t reserved;
+    uint8_t data[];
+};
+
+/*
+ * \brief One-way latency estimate towards a remote peer.
+ *        One-way delays are measured relative to the minimum-delay path, which is assumed to be symmetric.
+ */
+struct gudp_one_way {
+    int64_t offset;       // remote clock minus local clock, now, in nanoseconds
+    double drift;         // offset drift, in nanoseconds per second
+    uint64_t rtt;         // minimum round-trip delay over the filter window, in nanoseconds
+    int64_t forward;      // local to remote delay of the last probe, in nanoseconds
+    int64_t backward;     // remote to local delay of the last probe, in nanoseconds
+    unsigned int samples; // number of samples in the filter window
+};
+
+/*
+ * \brief Fragmentation settings. Zero fields take default values.
+ */
+struct gudp_fragmentation {
+    unsigned int max_message;   // maximum message size, in bytes, 0 disables fragmentation
+    unsigned int fragment_size; // fragment payload size, in bytes, default and maximum is 1464
+    unsigned int timeout;       // time after which an incomplete message is discarded, in milliseconds, default is 1000
+    unsigned int slots;         // number of messages reassembled in parallel per peer, default is 2
+    unsigned int max_memory;    // cap on the reassembly memory of all peers, in bytes, default is 4MB
+};
+
+/*
+ * \brief Network impairment settings of one direction. Zero fields disable the corresponding impairment.
+ *        Losses follow a Gilbert-Elliott model: the stage switches between a good and a bad state,
+ *        with a different loss probability in each state. If burst_enter is 0, losses are Bernoulli trials.
+ */
+struct gudp_impairment {
+    uint64_t seed;        // pseudo-random generator seed, the same seed gives the same impairment sequence
+    double loss;          // loss probability (in the good state)
+    double burst_enter;   // probability to switch from the good state to the bad state
+    double burst_exit;    // probability to switch from the bad state to the good state
+    double burst_loss;    // loss probability in the bad state
+    unsigned int delay;   // fixed delay, in microseconds
+    unsigned int jitter;  // random extra delay, uniformly distributed in [0, jitter], in microseconds
+    double reorder;       // probability for a packet to skip the delay, and overtake the delayed ones
+    double duplicate;     // duplication probability
+    uint64_t rate;        // bandwidth cap, in bytes per second
+};
+
+struct gudp_impairment_stats {
+    uint64_t packets;     // number of packets that entered the stage
+    uint64_t lost;
+    uint64_t duplicated;
+    uint64_t reordered;
+    uint64_t overflows;   // number of packets dropped because too many packets were delayed
+};
+
+/*
+ * \brief Payload producer of a periodic sender. It fills buf (size bytes) with the next payload,
+ *        and returns the payload length, 0 to skip this period, or -1 to stop sending.
+ *        It may also stop or restart the periodic sender, in which case nothing is sent for this period.
+ */
+typedef int (* GUDP_PRODUCE_CALLBACK)(void * user, void * buf, unsigned int size);
+
+struct gudp_periodic {
+    uint64_t period;                 // nanoseconds
+    uint64_t spin;                   // how early the timer fires to spin until the deadline, in nanoseconds, 0 disables spinning
+    unsigned int size;               // size of the buffer passed to the producer, default is 1472
+    struct gudp_address address;     // destination
+    void * user;
+    GUDP_PRODUCE_CALLBACK fp_produce;
+};
+
+#define GUDP_PERIODIC_HISTOGRAM 32
+
+struct gudp_periodic_stats {
+    uint64_t sends;       // number of successful sends
+    uint64_t failed;      // number of sends that failed, which are not part of the error statistics
+    uint64_t missed;      // number of periods skipped because the event loop woke up more than a period late
+    uint64_t max_error;   // maximum send time error, in nanoseconds
+    uint64_t total_error; // in nanoseconds
+    uint64_t spin;        // time spent spinning, in nanoseconds
+    uint64_t histogram[GUDP_PERIODIC_HISTOGRAM]; // bucket 0 counts errors below 2ns, bucket i counts errors in [2^i, 2^(i+1)) ns
+};
+
+typedef int (* GUDP_CAPTURE_CALLBACK)(void * user, const struct gudp_capture_record * record);
+
 /*
  * \brief Try to parse an address with the following expected format: a.b.c.d:e
  *        where a.b.c.d is an IPv4 address and e is a port.
@@ -151,6 +277,248 @@ int gudp_recv(struct gudp_socket * socket, void * buf, unsigned int count, unsig
  */
 int gudp_register(struct gudp_socket * socket, void * user, const GUDP_CALLBACKS * callbacks);
 
+/*
+ * \brief Pace the packets sent by a UDP socket, either socket-wide or towards a single remote address.
+ *        Each packet is given a nanosecond release time by a token bucket. Packets that cannot leave
+ *        right away are handed to the kernel (SO_TXTIME) if offload is allowed and supported, or held
+ *        in a release queue driven by a timerfd registered to the socket event sources.
+ *
+ * \param socket  the UDP socket
+ * \param address the remote address, or NULL for the socket-wide setting
+ * \param pacing  the pacing configuration (a zero rate disables pacing)
+ *
+ * \return 0 in case of success, or -1 in case of error
+ *
+ * \remark If the socket is not registered, gudp_send waits until the release time.
+ *         Setting a configuration resets the statistics.
+ *         Offload has to be chosen explicitly: the kernel accepts SO_TXTIME and SO_MAX_PACING_RATE whatever
+ *         the egress qdisc is, but only paces packets with the fq (or etf for SO_TXTIME) qdisc.
+ *         With SO_TXTIME, the reported delays are the release times handed to the kernel.
+ */
+int gudp_set_pacing(struct gudp_socket * socket, const struct gudp_address * address,
+        const struct gudp_pacing * pacing);
+
+/*
+ * \brief Get pacing statistics, either socket-wide or for a single remote address.
+ *
+ * \param socket  the UDP socket
+ * \param address the remote address, or NULL for the socket-wide statistics
+ * \param stats   where to store the statistics
+ *
+ * \return 0 in case of success, or -1 in case of error (e.g. no pacing configured for address)
+ */
+int gudp_get_pacing_stats(struct gudp_socket * socket, const struct gudp_address * address,
+        struct gudp_pacing_stats * stats);
+
+/*
+ * \brief Enable or disable delta encoding, either for all peers or for a single remote address.
+ *        Each payload is compared with the last keyframe sent to the peer, and only a bitmask of the changed
+ *        bytes and their xor with the keyframe are sent. Receivers rebuild the full payload before calling
+ *        fp_read. A keyframe is sent every interval packets, or when the payload size changes, or when
+ *        the delta would not be smaller than the payload. Payloads that do not fit in a single datagram
+ *        are sent as is when fragmentation is enabled (see gudp_set_fragmentation).
+ *
+ * \param socket   the UDP socket
+ * \param address  the remote address, or NULL for the default setting of all peers
+ * \param interval the maximum number of deltas between two keyframes, 0 disables delta encoding
+ *
+ * \return 0 in case of success, or -1 in case of error
+ *
+ * \remark Both peers must enable delta encoding. Deltas received after a lost keyframe are dropped
+ *         until the next keyframe. Without fragmentation, the 2-byte frame header lowers the maximum payload
+ *         size to 1470 bytes. The receive state of a peer is only created when a keyframe is received
+ *         from it, and at most 1024 peers are tracked.
+ */
+int gudp_set_delta(struct gudp_socket * socket, const struct gudp_address * address, unsigned int interval);
+
+/*
+ * \brief Enable or disable the latest value receive mode.
+ *        On each readiness event, the receive queue is drained, only the most recent datagram from each peer
+ *        is kept, and fp_read is called once per peer. gudp_get_superseded tells how many older datagrams
+ *        from that peer were discarded.
+ *
+ * \param socket  the UDP socket
+ * \param enable  1 to enable, 0 to disable
+ *
+ * \return 0 in case of success, or -1 in case of error
+ *
+ * \remark At most 4096 datagrams are drained per event, so that a flooding peer cannot starve the event loop.
+ */
+int gudp_set_latest(struct gudp_socket * socket, int enable);
+
+/*
+ * \brief Get the number of datagrams superseded by the one passed to the read callback being called.
+ *
+ * \param socket  the UDP socket
+ *
+ * \return the number of superseded datagrams (always 0 outside the latest value mode)
+ */
+unsigned int gudp_get_superseded(struct gudp_socket * socket);
+
+/*
+ * \brief Configure message fragmentation.
+ *        Messages that do not fit in a datagram are split into fragments, and fp_read is called once
+ *        all fragments of a message were received. Fragments are copied straight to their offset in a
+ *        preallocated per-peer reassembly buffer, so that the reassembled message is never copied again.
+ *
+ * \param socket  the UDP socket
+ * \param config  the fragmentation settings
+ *
+ * \return 0 in case of success, or -1 in case of error
+ *
+ * \remark Both peers must enable fragmentation. Reassembly buffers are allocated when the first fragment
+ *         from a peer is received, and fragments are dropped if this would exceed max_memory.
+ *         With delta encoding, messages that do not fit in a single datagram are sent as is, behind a
+ *         2-byte header, and do not change the delta reference.
+ */
+int gudp_set_fragmentation(struct gudp_socket * socket, const struct gudp_fragmentation * config);
+
+/*
+ * \brief Emulate network impairments on the packets sent or received by a UDP socket.
+ *        Packets are impaired at the datagram level, after fragmentation and before pacing when sending,
+ *        and before any other processing when receiving. Delayed packets are released by a timer wheel
+ *        driven by the registered event loop, with a 10 microsecond resolution.
+ *
+ * \param socket      the UDP socket
+ * \param direction   the direction to impair
+ * \param impairment  the impairment settings, or NULL to stop impairing packets
+ *
+ * \return 0 in case of success, or -1 in case of error
+ *
+ * \remark This is only available if the library is built with IMPAIRMENT=1.
+ *         Given a seed, the packets that are lost, duplicated, reordered or jittered only depend on
+ *         the packet order. Packets released from the wheel are not coalesced in latest value mode.
+ */
+int gudp_set_impairment(struct gudp_socket * socket, enum gudp_direction direction,
+        const struct gudp_impairment * impairment);
+
+/*
+ * \brief Get the impairment statistics of one direction.
+ *
+ * \param socket     the UDP socket
+ * \param direction  the direction
+ * \param stats      where to store the statistics
+ *
+ * \return 0 in case of success, or -1 in case of error
+ */
+int gudp_get_impairment_stats(struct gudp_socket * socket, enum gudp_direction direction,
+        struct gudp_impairment_stats * stats);
+
+/*
+ * \brief Start sending a payload periodically.
+ *        Deadlines are multiples of the period since the start, so that errors do not accumulate.
+ *        A timerfd registered to the socket event sources fires spin nanoseconds before each deadline,
+ *        the producer is called, and the event loop spins on the monotonic clock until the deadline,
+ *        then calls gudp_send. The difference between the send time and the deadline is recorded.
+ *
+ * \param socket    the UDP socket, which has to be registered
+ * \param periodic  the periodic sender configuration
+ *
+ * \return 0 in case of success, or -1 in case of error
+ *
+ * \remark Spinning blocks the event loop: spin has to be larger than the timer wakeup latency for sub-microsecond
+ *         accuracy, at the cost of up to spin nanoseconds of CPU time per period.
+ *         Starting again replaces the current configuration and resets the statistics.
+ */
+int gudp_periodic_start(struct gudp_socket * socket, const struct gudp_periodic * periodic);
+
+/*
+ * \brief Stop sending periodically.
+ *
+ * \param socket  the UDP socket
+ *
+ * \return 0 in case of success, or -1 in case of error
+ */
+int gudp_periodic_stop(struct gudp_socket * socket);
+
+/*
+ * \brief Get the send time error statistics of the periodic sender.
+ *
+ * \param socket  the UDP socket
+ * \param stats   where to store the statistics
+ *
+ * \return 0 in case of success, or -1 in case of error
+ */
+int gudp_get_periodic_stats(struct gudp_socket * socket, struct gudp_periodic_stats * stats);
+
+/*
+ * \brief Start capturing the packets received and sent by a UDP socket.
+ *        Records are appended to a memory-mapped ring file that is created and sized upfront,
+ *        so that capturing a packet does not involve any system call.
+ *        When the ring is full, the oldest records are overwritten.
+ *
+ * \param socket  the UDP socket
+ * \param path    the capture file, which is truncated
+ * \param size    the size of the ring, in bytes
+ *
+ * \return 0 in case of success, or -1 in case of error
+ *
+ * \remark Both directions are captured at the application layer: sent payloads when gudp_send is called,
+ *         before delta encoding, fragmentation, impairment and pacing, and received payloads when they are
+ *         passed to the read callback, after impairment, reassembly and delta decoding. Fragments, clock probes,
+ *         and datagrams superseded in latest value mode are not captured.
+ */
+int gudp_capture_start(struct gudp_socket * socket, const char * path, unsigned int size);
+
+/*
+ * \brief Stop capturing the packets of a UDP socket, and close the capture file.
+ *
+ * \param socket  the UDP socket
+ *
+ * \return 0 in case of success, or -1 in case of error
+ */
+int gudp_capture_stop(struct gudp_socket * socket);
+
+/*
+ * \brief Read a capture file, from the oldest to the newest record.
+ *
+ * \param path       the capture file
+ * \param user       the user to pass to the callback
+ * \param fp_record  the callback to call for each record, a non-zero return value stops the iteration
+ *
+ * \return the number of records read, or -1 in case of error
+ */
+int gudp_capture_read(const char * path, void * user, GUDP_CAPTURE_CALLBACK fp_record);
+
+/*
+ * \brief Enable or disable clock probe handling on a UDP socket.
+ *        When enabled, probes received by the read callback are answered (responder side) or used to update
+ *        the clock estimate of the remote peer (prober side), and are not passed to fp_read.
+ *
+ * \param socket  the UDP socket
+ * \param enable  1 to enable, 0 to disable
+ *
+ * \return 0 in case of success, or -1 in case of error
+ *
+ * \remark Application packets must not start with the probe magic ("GUCK") while probe handling is enabled.
+ */
+int gudp_clock_enable(struct gudp_socket * socket, int enable);
+
+/*
+ * \brief Send a timestamped clock probe to a remote peer, which should have probe handling enabled.
+ *        This enables probe handling on the socket. Probes should be sent periodically, e.g. every second.
+ *
+ * \param socket  the UDP socket
+ * \param address the remote address
+ *
+ * \return 0 in case of success, or -1 in case of error
+ *
+ * \remark Probes and their responses bypass pacing and capture, but go through the impairment stages.
+ */
+int gudp_clock_probe(struct gudp_socket * socket, struct gudp_address address);
+
+/*
+ * \brief Estimate the clock offset and the one-way delays towards a remote peer.
+ *        The offset is taken from the minimum-delay sample of the last probes, and projected to now using the drift.
+ *
+ * \param socket   the UDP socket
+ * \param address  the remote address
+ * \param estimate where to store the estimate
+ *
+ * \return 0 in case of success, or -1 in case of error (e.g. no probe response received yet)
+ */
+int gudp_estimate_one_way(struct gudp_socket * socket, struct gudp_address address, struct gudp_one_way * estimate);
+
 /*
  * \brief Close a UDP socket.
  *
@@ -160,4 +528,8 @@ int gudp_register(struct gudp_socket * socket, void * user, const GUDP_CALLBACKS
  */
 int gudp_close(struct gudp_socket * socket);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* GUDP_H_ */
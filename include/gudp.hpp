@@ -0,0 +1,244 @@
+/*
+ Copyright (c) 2020 Mathieu Laurendeau <mat.lau@laposte.net>
+ License: GPLv3
+ */
+
+#ifndef GUDP_HPP_
+#define GUDP_HPP_
+
+#include <coroutine>
+#include <cstddef>
+#include <cstring>
+#include <exception>
+#include <span>
+#include <stdexcept>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "gudp.h"
+
+/*
+ * Header-only C++20 layer over the gudp C API.
+ *
+ * The read callback resumes the coroutine awaiting sock.recv() directly, with a view of the
+ * received packet: no copy, no std::function, and no heap allocation per operation.
+ */
+namespace gudp {
+
+/*
+ * \brief A received datagram.
+ *
+ * \remark data is only valid until the receiving coroutine suspends again.
+ */
+struct datagram {
+    std::span<const std::byte> data;
+    int status; // the number of bytes received, or -1 in case of error
+    gudp_address address;
+};
+
+/*
+ * \brief A fire-and-forget coroutine, started eagerly and destroyed on completion.
+ */
+struct task {
+    struct promise_type {
+        task get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+/*
+ * \brief Move-only RAII wrapper around a UDP socket.
+ */
+class socket {
+
+    // the registered user, allocated once per socket so that the socket can be moved
+    struct state {
+        gudp_socket * s = nullptr;
+        std::coroutine_handle<> waiter;
+        datagram * result = nullptr;
+        // holds a packet received while no coroutine is waiting, grown for reassembled messages
+        std::vector<std::byte> buffer = std::vector<std::byte>(1472);
+        datagram pending = {};
+        bool has_pending = false;
+        unsigned long long dropped = 0;
+        int interrupt = 0;       // value returned by the callback, to make gpoll return
+        bool dispatching = false; // a coroutine is being resumed from a callback
+        bool closed = false;      // the socket was closed while dispatching
+    };
+
+    // resume the waiting coroutine, which may close the socket
+    static int dispatch(state * st, const datagram & dg) {
+
+        *st->result = dg;
+        st->dispatching = true;
+        std::exchange(st->waiter, nullptr).resume();
+        st->dispatching = false;
+        int ret = std::exchange(st->interrupt, 0);
+        if (st->closed) {
+            delete st;
+        }
+        return ret;
+    }
+
+    state * st_ = nullptr;
+
+    static int on_read(void * user, const void * buf, int status, gudp_address address) {
+
+        state * st = static_cast<state *>(user);
+        datagram dg = { {}, status, address };
+        if (status > 0) {
+            dg.data = std::span<const std::byte>(static_cast<const std::byte *>(buf), status);
+        }
+        if (st->waiter) {
+            int ret = dispatch(st, dg);
+            return status < 0 ? 1 : ret;
+        }
+        if (status >= 0) {
+            if (st->buffer.size() < static_cast<size_t>(status)) {
+                try {
+                    st->buffer.resize(status);
+                } catch (const std::bad_alloc &) {
+                    // keep the previous packet, if any
+                    ++st->dropped;
+                    return 0;
+                }
+            }
+            if (st->has_pending) {
+                ++st->dropped;
+            }
+            std::memcpy(st->buffer.data(), buf, status);
+            st->pending = { std::span<const std::byte>(st->buffer.data(), status), status, address };
+            st->has_pending = true;
+        }
+        return status < 0 ? 1 : 0;
+    }
+
+    static int on_close(void * user) {
+
+        state * st = static_cast<state *>(user);
+        if (st->waiter) {
+            dispatch(st, { {}, -1, {} });
+        }
+        return 1;
+    }
+
+public:
+
+    class recv_awaiter {
+        state * st_;
+        datagram result_ = {};
+    public:
+        explicit recv_awaiter(state * st) noexcept : st_(st) {}
+        bool await_ready() noexcept {
+            if (!st_->has_pending) {
+                return false;
+            }
+            result_ = st_->pending;
+            st_->has_pending = false;
+            return true;
+        }
+        void await_suspend(std::coroutine_handle<> h) noexcept {
+            st_->waiter = h;
+            st_->result = &result_;
+        }
+        datagram await_resume() const noexcept { return result_; }
+    };
+
+    // gudp_send never blocks on a registered socket, so sending completes synchronously
+    class send_awaiter {
+        int ret_;
+    public:
+        explicit send_awaiter(int ret) noexcept : ret_(ret) {}
+        bool await_ready() const noexcept { return true; }
+        void await_suspend(std::coroutine_handle<>) const noexcept {}
+        int await_resume() const noexcept { return ret_; }
+    };
+
+    /*
+     * \brief Open a UDP socket, see gudp_open.
+     *
+     * \throw std::runtime_error if the socket cannot be opened
+     */
+    socket(gudp_mode mode, gudp_address address) : st_(new state) {
+
+        st_->s = gudp_open(mode, address);
+        if (st_->s == nullptr) {
+            delete st_;
+            throw std::runtime_error("gudp_open failed");
+        }
+    }
+
+    socket(const socket &) = delete;
+    socket & operator=(const socket &) = delete;
+
+    socket(socket && other) noexcept : st_(std::exchange(other.st_, nullptr)) {}
+
+    socket & operator=(socket && other) noexcept {
+        if (this != &other) {
+            close();
+            st_ = std::exchange(other.st_, nullptr);
+        }
+        return *this;
+    }
+
+    /*
+     * \remark A coroutine still waiting in recv() is not resumed.
+     */
+    ~socket() { close(); }
+
+    void close() noexcept {
+        if (st_ != nullptr) {
+            gudp_close(st_->s);
+            if (st_->dispatching) {
+                st_->closed = true;
+            } else {
+                delete st_;
+            }
+            st_ = nullptr;
+        }
+    }
+
+    /*
+     * \brief Register the socket as an event source, see gudp_register.
+     *
+     * \return 0 in case of success, or -1 in case of error
+     */
+    int attach(GUDP_REGISTER_SOURCE fp_register, GUDP_REMOVE_SOURCE fp_remove) noexcept {
+        GUDP_CALLBACKS callbacks = {
+                .fp_read = on_read,
+                .fp_close = on_close,
+                .fp_register = fp_register,
+                .fp_remove = fp_remove,
+        };
+        return gudp_register(st_->s, st_, &callbacks);
+    }
+
+    /*
+     * \brief Wait for the next datagram. Only one coroutine may wait at a time.
+     *
+     * \remark A datagram received while no coroutine is waiting is kept until the next call,
+     *         and replaces any datagram kept before (see dropped()).
+     */
+    recv_awaiter recv() noexcept { return recv_awaiter(st_); }
+
+    send_awaiter send(std::span<const std::byte> data, gudp_address address) noexcept {
+        return send_awaiter(gudp_send(st_->s, data.data(), data.size(), address));
+    }
+
+    /*
+     * \brief Make gpoll return once the coroutine resumed by the current callback suspends or completes.
+     */
+    void interrupt() noexcept { st_->interrupt = 1; }
+
+    unsigned long long dropped() const noexcept { return st_->dropped; }
+
+    gudp_socket * native_handle() const noexcept { return st_->s; }
+};
+
+} // namespace gudp
+
+#endif /* GUDP_HPP_ */
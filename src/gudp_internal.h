@@ -0,0 +1,378 @@
+/*
+ Copyright (c) 2020 Mathieu Laurendeau <mat.lau@laposte.net>
+ License: GPLv3
+ */
+
+#ifndef GUDP_INTERNAL_H_
+#define GUDP_INTERNAL_H_
+
+#include <gudp.h>
+#ifndef WIN32
+#include <time.h>
+#else
+#include <windows.h>
+#endif
+
+/*
+ * Token bucket, implemented as a generic cell rate algorithm:
+ * a packet may leave at time t if tat - t <= tau.
+ */
+struct gudp_bucket {
+    uint64_t rate;  // bytes per second, 0 means disabled
+    uint64_t tau;   // burst tolerance, in nanoseconds
+    uint64_t tat;   // theoretical arrival time, in nanoseconds
+    uint64_t first; // time of the first packet since configuration
+    uint64_t first_bytes;
+    uint64_t last;  // time of the last packet
+    struct gudp_pacing_stats stats;
+};
+
+#define GUDP_DATAGRAM_MAX 1472 // the classical 1500-byte MTU size minus IP and UDP headers
+
+#define GUDP_CLOCK_SAMPLES 16
+
+struct gudp_clock_sample {
+    uint64_t local;  // local time at the middle of the exchange, in nanoseconds
+    int64_t offset;  // remote clock minus local clock, in nanoseconds
+    uint64_t delay;  // round-trip delay, excluding the remote processing time
+};
+
+/*
+ * Clock offset estimation state, fed by probe exchanges.
+ */
+struct gudp_clock {
+    struct gudp_clock_sample samples[GUDP_CLOCK_SAMPLES]; // ring of the last samples
+    unsigned int next;
+    unsigned int count;
+    uint32_t seq;         // sequence number of the last probe sent
+    int pending;          // the last probe was not answered yet
+    uint64_t last[4];     // timestamps of the last exchange
+};
+
+/*
+ * Delta codec state: payloads are sent as differences with the last keyframe.
+ */
+struct gudp_delta {
+    unsigned int interval; // maximum number of deltas between two keyframes, 0 means disabled
+    struct {
+        uint8_t state[GUDP_DATAGRAM_MAX]; // reference keyframe
+        unsigned int count;               // reference length
+        uint8_t id;                       // reference id
+        unsigned int sent;                // number of deltas sent since the reference
+    } tx;
+    struct {
+        uint8_t state[GUDP_DATAGRAM_MAX];
+        unsigned int count;
+        uint8_t id;
+        int valid;                        // a keyframe was received
+    } rx;
+};
+
+#define GUDP_FRAGMENTS_MAX 255
+
+#define GUDP_PEERS_MAX 1024 // maximum number of remote peers with a state
+#define GUDP_PEERS_HASH_BITS 8 // peer lookup hash table of 256 buckets
+
+/*
+ * Reassembly slot: fragment payloads are stored at their final offset in a contiguous buffer.
+ */
+struct gudp_fragment_slot {
+    int busy;
+    uint16_t id;
+    unsigned int total;                          // number of fragments
+    unsigned int size;                           // fragment payload size
+    unsigned int nb_received;
+    uint8_t received[(GUDP_FRAGMENTS_MAX + 7) / 8]; // one bit per received fragment
+    unsigned int length;                         // message length, known once the last fragment is received
+    uint64_t first;                              // arrival time of the first fragment, in nanoseconds
+    uint8_t * buffer;                            // max_message bytes
+};
+
+/*
+ * Per-remote-peer state.
+ */
+struct gudp_peer {
+    struct gudp_address address;
+    struct gudp_bucket bucket;
+    struct gudp_clock clock;
+    struct gudp_delta * delta;
+    struct gudp_fragment_slot * fragments; // allocated on the first fragment
+    unsigned int nb_fragments;
+    struct gudp_peer * next; // next peer in the same hash bucket
+};
+
+struct gudp_paced_packet {
+    uint64_t queued;  // time the packet was queued, in nanoseconds
+    uint64_t release; // time the packet should leave, in nanoseconds
+    struct gudp_address address;
+    unsigned int count;
+    struct gudp_paced_packet * next;
+    uint8_t data[];
+};
+
+#define GUDP_CAPTURE_MAGIC "GUDPCAP"
+#define GUDP_CAPTURE_VERSION 1
+
+/*
+ * Capture file header, followed by the record ring.
+ * Offsets are logical positions that increase forever: the physical offset is position % size.
+ * A record never wraps around the end of the ring: a zero length marks the end of a lap.
+ */
+struct gudp_capture_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t size;    // size of the ring, in bytes
+    uint64_t head;    // position of the next record
+    uint64_t tail;    // position of the oldest record
+    uint64_t records; // number of captured records
+    uint64_t dropped; // number of overwritten or oversized records
+};
+
+#define GUDP_LATEST_BATCH 16 // number of datagrams received per system call in latest value mode
+
+/*
+ * Latest datagram received from a peer while draining the receive queue.
+ */
+struct gudp_latest_slot {
+    struct gudp_address address;
+    int count;               // -1 if no datagram
+    unsigned int superseded; // number of datagrams replaced by a newer one
+    uint8_t * buffer;
+};
+
+#ifdef GUDP_IMPAIRMENT
+
+#ifdef WIN32
+#error "impairment emulation is not supported on this platform"
+#endif
+
+#define GUDP_WHEEL_SLOTS 4096 // must be a multiple of 64
+
+/*
+ * Impairment stage of one direction.
+ */
+struct gudp_impairment_stage {
+    struct gudp_impairment config;
+    uint64_t random;  // pseudo-random generator state
+    int bad;          // Gilbert-Elliott state
+    uint64_t link;    // time the emulated link is idle, in nanoseconds
+    struct gudp_impairment_stats stats;
+};
+
+struct gudp_impaired_packet {
+    uint64_t release; // time the packet should leave the stage, in nanoseconds
+    uint64_t tick;    // wheel tick of the release time
+    enum gudp_direction direction;
+    int paced;        // sent packets only: release through the pacing queue
+    struct gudp_address address;
+    unsigned int count;
+    struct gudp_impaired_packet * next;
+    uint8_t data[];
+};
+
+#endif
+
+struct gudp_socket {
+    int fd;
+    enum gudp_mode mode;
+    GUDP_CALLBACKS callbacks;
+    void * user;
+    uint8_t buffer[GUDP_DATAGRAM_MAX];
+    struct gudp_peer ** peers;
+    unsigned int nb_peers;
+    struct gudp_peer * buckets[1 << GUDP_PEERS_HASH_BITS]; // peers hashed by address
+    struct {
+        struct gudp_bucket bucket;
+        unsigned int nb_peers;            // number of peers with a pacing rate
+        enum gudp_pacing_offload offload;
+        int timer;                        // timerfd driving the release queue, -1 if not created
+        struct gudp_paced_packet * head;  // release queue, sorted by release time
+        struct gudp_paced_packet * tail;
+        unsigned int queued;              // number of packets in the release queue
+    } pacing;
+    struct {
+        struct gudp_capture_header * header; // mapped capture file, NULL if not capturing
+        uint8_t * ring;
+        size_t length;                       // mapping length
+    } capture;
+    int clock;                               // clock probes are intercepted
+    struct {
+        int enabled;
+        uint8_t * batch[GUDP_LATEST_BATCH];  // receive buffers
+        struct gudp_latest_slot * slots;     // one slot per peer seen during a drain
+        unsigned int nb_slots;
+        unsigned int allocated;
+        unsigned int superseded;             // value reported to the read callback being called
+    } latest;
+    struct {
+        int used;                            // delta encoding was configured at least once
+        unsigned int interval;               // default keyframe interval for new peers
+        uint8_t out[GUDP_DATAGRAM_MAX];      // encoded frame
+        uint8_t in[GUDP_DATAGRAM_MAX];       // decoded state
+        uint8_t * raw;                       // passthrough frame of a payload larger than out
+        unsigned int raw_size;
+    } delta;
+    struct {
+        struct gudp_fragmentation config;    // max_message is 0 if fragmentation is disabled
+        uint16_t id;                         // id of the next message
+        size_t memory;                       // memory used by reassembly slots
+        uint8_t out[GUDP_DATAGRAM_MAX];      // fragment being sent
+    } fragment;
+    struct {
+        struct gudp_periodic config;         // fp_produce is NULL if stopped
+        int timer;                           // timerfd, -1 if not created
+        uint64_t deadline;                   // next send time, in nanoseconds
+        uint8_t * buffer;                    // payload buffer
+        struct gudp_periodic_stats stats;
+    } periodic;
+#ifdef GUDP_IMPAIRMENT
+    struct {
+        struct gudp_impairment_stage * stages[2];                // indexed by direction, NULL if disabled
+        int timer;                                               // timerfd driving the wheel, -1 if not created
+        uint64_t tick;                                           // last processed tick
+        uint64_t armed;                                          // tick the timer is armed for, 0 if disarmed
+        struct gudp_impaired_packet * wheel[GUDP_WHEEL_SLOTS];   // packets sorted by release time in each slot
+        uint64_t used[GUDP_WHEEL_SLOTS / 64];                    // non-empty slots
+        unsigned int queued;                                     // number of packets in the wheel
+    } impairment;
+#endif
+};
+
+/*
+ * Get the state of a remote peer, optionally creating it.
+ * Returns NULL if the peer does not exist and create is 0, if GUDP_PEERS_MAX peers already exist,
+ * or in case of allocation failure.
+ */
+struct gudp_peer * gudp_peer_get(struct gudp_socket * socket, struct gudp_address address, int create);
+
+/*
+ * Send a datagram right away, optionally with a kernel release time (0 means none).
+ */
+int gudp_sendto(struct gudp_socket * socket, const void * buf, unsigned int count, struct gudp_address address,
+        uint64_t txtime);
+
+/*
+ * Send a datagram, through the impairment stage if enabled, and then through gudp_send_datagram.
+ */
+int gudp_send_frame(struct gudp_socket * socket, const void * buf, unsigned int count, struct gudp_address address,
+        int paced);
+
+/*
+ * Send a datagram, through the pacing queue if paced is set and pacing is enabled.
+ */
+int gudp_send_datagram(struct gudp_socket * socket, const void * buf, unsigned int count,
+        struct gudp_address address, int paced);
+
+/*
+ * Process a received datagram (clock probes, fragments, delta decoding), and call the read callback.
+ * Returns the value returned by the read callback, or 0 if it was not called.
+ */
+int gudp_deliver(struct gudp_socket * socket, const uint8_t * buf, int count, struct gudp_address address);
+
+/*
+ * Capture a received payload if capturing, and pass it to the read callback.
+ */
+int gudp_read(struct gudp_socket * socket, const void * buf, int count, struct gudp_address address);
+
+int gudp_pacing_send(struct gudp_socket * socket, const void * buf, unsigned int count, struct gudp_address address);
+void gudp_pacing_clean(struct gudp_socket * socket);
+
+void gudp_capture(struct gudp_socket * socket, enum gudp_direction direction, const void * buf, unsigned int count,
+        struct gudp_address address);
+
+/*
+ * Handle a clock probe. Returns 1 if the packet was a probe, 0 otherwise.
+ */
+int gudp_clock_process(struct gudp_socket * socket, const void * buf, unsigned int count, struct gudp_address address);
+
+/*
+ * Drain the receive queue and call the read callback once per peer, with its latest datagram.
+ */
+int gudp_latest_read(struct gudp_socket * socket);
+void gudp_latest_clean(struct gudp_socket * socket);
+
+/*
+ * Encode a payload for a peer. out points to the frame to send, which is buf if delta encoding is disabled.
+ * Returns the frame length, or -1 in case of error.
+ */
+int gudp_delta_encode(struct gudp_socket * socket, const void * buf, unsigned int count, struct gudp_address address,
+        const uint8_t ** out);
+
+/*
+ * Decode a frame from a peer, using out as the output buffer if needed. state points to the decoded state,
+ * which is frame if delta encoding is disabled. Returns the state length, or -1 if the frame cannot be decoded.
+ */
+int gudp_delta_decode(struct gudp_socket * socket, const uint8_t * frame, int count, struct gudp_address address,
+        uint8_t * out, const uint8_t ** state);
+
+/*
+ * Send a message, split into fragments if it does not fit in a datagram.
+ */
+int gudp_fragment_send(struct gudp_socket * socket, const void * buf, unsigned int count, struct gudp_address address);
+
+/*
+ * Handle a received datagram. Returns the original count with slot set to NULL if the datagram is not a fragment,
+ * the message length with slot set to the reassembly slot if the message is complete, or 0 otherwise.
+ * A completed slot must be released once the message has been consumed.
+ */
+int gudp_fragment_process(struct gudp_socket * socket, const uint8_t * buf, unsigned int count,
+        struct gudp_address address, struct gudp_fragment_slot ** slot);
+void gudp_fragment_release(struct gudp_fragment_slot * slot);
+void gudp_fragment_clean(struct gudp_socket * socket, struct gudp_peer * peer);
+
+#ifdef GUDP_IMPAIRMENT
+/*
+ * Apply the impairment stage of a direction to a datagram. Delayed copies are queued in the timer wheel,
+ * and sent datagrams are released with gudp_send_datagram(paced).
+ * Returns the number of copies to pass on right away (0, 1, or 2 if the datagram is duplicated).
+ */
+int gudp_impairment_process(struct gudp_socket * socket, enum gudp_direction direction, const void * buf,
+        unsigned int count, struct gudp_address address, int paced);
+void gudp_impairment_clean(struct gudp_socket * socket);
+#endif
+
+#ifndef WIN32
+/*
+ * Create a timer and register it with the socket callbacks, with the socket as user data.
+ * A failure of the timer closes the socket.
+ */
+int gudp_timer_open(struct gudp_socket * socket, GPOLL_READ_CALLBACK fp_read, int * fd);
+
+/*
+ * Arm a timer to expire at an absolute time of gudp_time_ns(), or disarm it if deadline is 0.
+ */
+int gudp_timer_arm(int fd, uint64_t deadline);
+
+/*
+ * Consume the expirations of a timer, from its read callback.
+ */
+int gudp_timer_read(int fd);
+
+/*
+ * Remove and close a timer, if open.
+ */
+void gudp_timer_close(struct gudp_socket * socket, int * fd);
+#endif
+
+static inline int gudp_pacing_enabled(struct gudp_socket * socket) {
+    return socket->pacing.bucket.rate || socket->pacing.nb_peers || socket->pacing.head;
+}
+
+#ifndef WIN32
+static inline uint64_t gudp_time_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#else
+static inline uint64_t gudp_time_ns() {
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return counter.QuadPart / frequency.QuadPart * 1000000000ULL
+            + counter.QuadPart % frequency.QuadPart * 1000000000ULL / frequency.QuadPart;
+}
+#endif
+
+#endif /* GUDP_INTERNAL_H_ */
@@ -0,0 +1,207 @@
+/*
+ Copyright (c) 2020 Mathieu Laurendeau <mat.lau@laposte.net>
+ License: GPLv3
+ */
+
+#include <src/gudp_internal.h>
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <gimxcommon/include/gerror.h>
+
+#define RECORD_ALIGN(LENGTH) (((LENGTH) + 7) & ~7ULL)
+
+void gudp_capture(struct gudp_socket * socket, enum gudp_direction direction, const void * buf, unsigned int count,
+        struct gudp_address address) {
+
+#ifndef WIN32
+    struct gudp_capture_header * header = socket->capture.header;
+
+    uint64_t length = RECORD_ALIGN(sizeof(struct gudp_capture_record) + count);
+    if (length > header->size) {
+        ++header->dropped;
+        return;
+    }
+
+    uint64_t offset = header->head % header->size;
+    uint64_t start = header->head;
+    if (offset + length > header->size) {
+        start += header->size - offset;
+    }
+    uint64_t end = start + length;
+
+    // release the oldest records that are about to be overwritten
+    while (header->tail < header->head && end - header->tail > header->size) {
+        uint64_t tail = header->tail % header->size;
+        const struct gudp_capture_record * record = (const struct gudp_capture_record *) (socket->capture.ring + tail);
+        if (record->length == 0) {
+            header->tail += header->size - tail;
+        } else {
+            header->tail += record->length;
+            ++header->dropped;
+        }
+    }
+    if (end - header->tail > header->size) {
+        header->tail = start;
+    }
+
+    if (start != header->head) {
+        ((struct gudp_capture_record *) (socket->capture.ring + offset))->length = 0;
+    }
+
+    struct gudp_capture_record * record = (struct gudp_capture_record *) (socket->capture.ring + start % header->size);
+    record->length = length;
+    record->count = count;
+    record->timestamp = gudp_time_ns();
+    record->ip = address.ip;
+    record->port = address.port;
+    record->direction = direction;
+    record->reserved = 0;
+    memcpy(record->data, buf, count);
+
+    header->head = end;
+    ++header->records;
+#else
+    (void) socket;
+    (void) direction;
+    (void) buf;
+    (void) count;
+    (void) address;
+#endif
+}
+
+int gudp_capture_start(struct gudp_socket * socket, const char * path, unsigned int size) {
+
+#ifndef WIN32
+    if (socket->capture.header != NULL && gudp_capture_stop(socket) < 0) {
+        return -1;
+    }
+
+    size &= ~7U;
+    if (size < sizeof(struct gudp_capture_record)) {
+        PRINT_ERROR_OTHER("capture size is too small");
+        return -1;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        PRINT_ERROR_ERRNO("open");
+        return -1;
+    }
+
+    size_t length = sizeof(struct gudp_capture_header) + size;
+
+    if (ftruncate(fd, length) < 0) {
+        PRINT_ERROR_ERRNO("ftruncate");
+        close(fd);
+        return -1;
+    }
+
+    void * map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        PRINT_ERROR_ERRNO("mmap");
+        return -1;
+    }
+
+    struct gudp_capture_header * header = (struct gudp_capture_header *) map;
+    memcpy(header->magic, GUDP_CAPTURE_MAGIC, sizeof(header->magic));
+    header->version = GUDP_CAPTURE_VERSION;
+    header->size = size;
+
+    socket->capture.header = header;
+    socket->capture.ring = (uint8_t *) map + sizeof(*header);
+    socket->capture.length = length;
+
+    return 0;
+#else
+    (void) socket;
+    (void) path;
+    (void) size;
+    PRINT_ERROR_OTHER("capture is not supported on this platform");
+    return -1;
+#endif
+}
+
+int gudp_capture_stop(struct gudp_socket * socket) {
+
+    if (socket->capture.header == NULL) {
+        return 0;
+    }
+
+    int ret = 0;
+
+#ifndef WIN32
+    if (munmap(socket->capture.header, socket->capture.length) < 0) {
+        PRINT_ERROR_ERRNO("munmap");
+        ret = -1;
+    }
+#endif
+
+    socket->capture.header = NULL;
+    socket->capture.ring = NULL;
+    socket->capture.length = 0;
+
+    return ret;
+}
+
+int gudp_capture_read(const char * path, void * user, GUDP_CAPTURE_CALLBACK fp_record) {
+
+    FILE * file = fopen(path, "rb");
+    if (file == NULL) {
+        PRINT_ERROR_OTHER("failed to open capture file");
+        return -1;
+    }
+
+    struct gudp_capture_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, GUDP_CAPTURE_MAGIC, sizeof(header.magic))
+            || header.version != GUDP_CAPTURE_VERSION || header.size == 0 || header.head - header.tail > header.size) {
+        PRINT_ERROR_OTHER("invalid capture file");
+        fclose(file);
+        return -1;
+    }
+
+    uint8_t * ring = malloc(header.size);
+    if (ring == NULL) {
+        PRINT_ERROR_ALLOC_FAILED("malloc");
+        fclose(file);
+        return -1;
+    }
+
+    int ret = 0;
+
+    if (fread(ring, header.size, 1, file) != 1) {
+        PRINT_ERROR_OTHER("truncated capture file");
+        ret = -1;
+    }
+
+    uint64_t position = header.tail;
+    while (ret >= 0 && position < header.head) {
+        uint64_t offset = position % header.size;
+        const struct gudp_capture_record * record = (const struct gudp_capture_record *) (ring + offset);
+        if (header.size - offset < sizeof(record->length) || record->length == 0) {
+            position += header.size - offset;
+            continue;
+        }
+        if (record->length < sizeof(*record) + record->count || offset + record->length > header.size) {
+            PRINT_ERROR_OTHER("corrupted capture record");
+            ret = -1;
+            break;
+        }
+        ++ret;
+        if (fp_record(user, record)) {
+            break;
+        }
+        position += record->length;
+    }
+
+    free(ring);
+    fclose(file);
+
+    return ret;
+}
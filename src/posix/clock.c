@@ -0,0 +1,213 @@
+/*
+ Copyright (c) 2020 Mathieu Laurendeau <mat.lau@laposte.net>
+ License: GPLv3
+ */
+
+#include <src/gudp_internal.h>
+#include <string.h>
+#include <gimxcommon/include/gerror.h>
+
+#define PROBE_MAGIC 0x4755434B // "GUCK"
+
+enum probe_type {
+    PROBE_REQUEST = 1,
+    PROBE_RESPONSE = 2,
+};
+
+/*
+ * Probe layout, all fields in network byte order:
+ * magic (4), type (1), reserved (3), seq (4), reserved (4), t1 (8), t2 (8), t3 (8)
+ * t1: prober send time, t2: responder receive time, t3: responder send time
+ */
+#define PROBE_SIZE 40
+
+#define DRIFT_MIN_SPAN 1000000000ULL // nanoseconds, shorter spans give unreliable drift estimates
+
+static void put32(uint8_t * p, uint32_t v) {
+    v = gudp_htonl(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static uint32_t get32(const uint8_t * p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return gudp_ntohl(v);
+}
+
+static void put64(uint8_t * p, uint64_t v) {
+    put32(p, v >> 32);
+    put32(p + 4, v);
+}
+
+static uint64_t get64(const uint8_t * p) {
+    return (uint64_t) get32(p) << 32 | get32(p + 4);
+}
+
+static int send_probe(struct gudp_socket * socket, struct gudp_address address, uint8_t type, uint32_t seq,
+        uint64_t t1, uint64_t t2) {
+
+    uint8_t probe[PROBE_SIZE] = { };
+    put32(probe, PROBE_MAGIC);
+    probe[4] = type;
+    put32(probe + 8, seq);
+    put64(probe + 16, t1);
+    put64(probe + 24, t2);
+    // take the send timestamp as late as possible
+    uint64_t t3 = gudp_time_ns();
+    if (type == PROBE_REQUEST) {
+        put64(probe + 16, t3);
+    } else {
+        put64(probe + 32, t3);
+    }
+
+    // bypass pacing and capture, so that timestamps are not biased, but not the emulated network
+    return gudp_send_frame(socket, probe, sizeof(probe), address, 0) < 0 ? -1 : 0;
+}
+
+static const struct gudp_clock_sample * best_sample(const struct gudp_clock * clock, unsigned int from,
+        unsigned int count) {
+
+    const struct gudp_clock_sample * best = NULL;
+    unsigned int i;
+    for (i = from; i < from + count; ++i) {
+        // oldest sample first
+        const struct gudp_clock_sample * sample = clock->samples
+                + (clock->next + GUDP_CLOCK_SAMPLES - clock->count + i) % GUDP_CLOCK_SAMPLES;
+        if (best == NULL || sample->delay < best->delay) {
+            best = sample;
+        }
+    }
+    return best;
+}
+
+static double drift(const struct gudp_clock * clock) {
+
+    if (clock->count < 4) {
+        return 0;
+    }
+
+    // compare the minimum-delay samples of the older and newer halves of the window
+    unsigned int half = clock->count / 2;
+    const struct gudp_clock_sample * old = best_sample(clock, 0, half);
+    const struct gudp_clock_sample * new = best_sample(clock, half, clock->count - half);
+    if (new->local < old->local + DRIFT_MIN_SPAN) {
+        return 0;
+    }
+    return (double) (new->offset - old->offset) * 1000000000.0 / (new->local - old->local);
+}
+
+static int64_t offset_at(const struct gudp_clock_sample * best, double drift, uint64_t local) {
+
+    return best->offset + (int64_t) (drift * ((int64_t) (local - best->local)) / 1000000000.0);
+}
+
+static void process_response(struct gudp_socket * socket, const uint8_t * probe, struct gudp_address address,
+        uint64_t t4) {
+
+    struct gudp_peer * peer = gudp_peer_get(socket, address, 0);
+    if (peer == NULL) {
+        return;
+    }
+
+    struct gudp_clock * clock = &peer->clock;
+
+    // ignore stale and duplicated responses
+    if (!clock->pending || get32(probe + 8) != clock->seq) {
+        return;
+    }
+    clock->pending = 0;
+
+    uint64_t t1 = get64(probe + 16);
+    uint64_t t2 = get64(probe + 24);
+    uint64_t t3 = get64(probe + 32);
+    if (t4 < t1 || t3 < t2 || t4 - t1 < t3 - t2) {
+        return;
+    }
+
+    struct gudp_clock_sample * sample = clock->samples + clock->next;
+    sample->local = t1 + (t4 - t1) / 2;
+    sample->offset = ((int64_t) (t2 - t1) + (int64_t) (t3 - t4)) / 2;
+    sample->delay = (t4 - t1) - (t3 - t2);
+
+    clock->next = (clock->next + 1) % GUDP_CLOCK_SAMPLES;
+    if (clock->count < GUDP_CLOCK_SAMPLES) {
+        ++clock->count;
+    }
+
+    clock->last[0] = t1;
+    clock->last[1] = t2;
+    clock->last[2] = t3;
+    clock->last[3] = t4;
+}
+
+int gudp_clock_process(struct gudp_socket * socket, const void * buf, unsigned int count, struct gudp_address address) {
+
+    uint64_t now = gudp_time_ns();
+
+    const uint8_t * probe = buf;
+    if (count != PROBE_SIZE || get32(probe) != PROBE_MAGIC) {
+        return 0;
+    }
+
+    switch (probe[4]) {
+    case PROBE_REQUEST:
+        send_probe(socket, address, PROBE_RESPONSE, get32(probe + 8), get64(probe + 16), now);
+        break;
+    case PROBE_RESPONSE:
+        process_response(socket, probe, address, now);
+        break;
+    default:
+        return 0;
+    }
+
+    return 1;
+}
+
+int gudp_clock_enable(struct gudp_socket * socket, int enable) {
+
+    socket->clock = enable;
+
+    return 0;
+}
+
+int gudp_clock_probe(struct gudp_socket * socket, struct gudp_address address) {
+
+    if (!address.ip || !address.port) {
+        PRINT_ERROR_OTHER("ip and port should not be 0");
+        return -1;
+    }
+
+    struct gudp_peer * peer = gudp_peer_get(socket, address, 1);
+    if (peer == NULL) {
+        return -1;
+    }
+
+    socket->clock = 1;
+
+    // a probe that was not answered is considered lost
+    peer->clock.pending = 1;
+    return send_probe(socket, address, PROBE_REQUEST, ++peer->clock.seq, 0, 0);
+}
+
+int gudp_estimate_one_way(struct gudp_socket * socket, struct gudp_address address, struct gudp_one_way * estimate) {
+
+    struct gudp_peer * peer = gudp_peer_get(socket, address, 0);
+    if (peer == NULL || peer->clock.count == 0) {
+        PRINT_ERROR_OTHER("no clock sample for this address");
+        return -1;
+    }
+
+    const struct gudp_clock * clock = &peer->clock;
+    const struct gudp_clock_sample * best = best_sample(clock, 0, clock->count);
+
+    estimate->drift = drift(clock);
+    estimate->offset = offset_at(best, estimate->drift, gudp_time_ns());
+    estimate->rtt = best->delay;
+    estimate->forward = (int64_t) (clock->last[1] - clock->last[0])
+            - offset_at(best, estimate->drift, clock->last[0]);
+    estimate->backward = (int64_t) (clock->last[3] - clock->last[2])
+            + offset_at(best, estimate->drift, clock->last[3]);
+    estimate->samples = clock->count;
+
+    return 0;
+}
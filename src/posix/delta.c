@@ -0,0 +1,287 @@
+/*
+ Copyright (c) 2020 Mathieu Laurendeau <mat.lau@laposte.net>
+ License: GPLv3
+ */
+
+#include <src/gudp_internal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gimxcommon/include/gerror.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Frame layout:
+ * keyframe: type (1), id (1), state
+ * delta:    type (1), id (1), changed-byte mask (1 bit per state byte), xor of the changed bytes
+ * raw:      type (1), unused (1), payload
+ * A delta is relative to the keyframe with the same id, so that losing a delta does not prevent
+ * decoding the next ones, and losing a keyframe is recovered by the next keyframe.
+ * Payloads that do not fit in a datagram (i.e. messages to fragment) are sent in raw frames,
+ * which leave the reference untouched.
+ */
+#define FRAME_KEYFRAME 0xD1
+#define FRAME_DELTA 0xD2
+#define FRAME_RAW 0xD3
+
+#define HEADER_SIZE 2
+
+#define MASK_SIZE(COUNT) (((COUNT) + 7) / 8)
+
+/*
+ * Set a bit in mask for each byte that differs between a and b, and return the number of differing bytes.
+ */
+static unsigned int diff_mask(const uint8_t * a, const uint8_t * b, unsigned int count, uint8_t * mask) {
+
+    unsigned int changed = 0;
+    unsigned int i = 0;
+
+#ifdef __SSE2__
+    for (; i + 16 <= count; i += 16) {
+        __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (a + i)),
+                _mm_loadu_si128((const __m128i *) (b + i)));
+        unsigned int bits = ~_mm_movemask_epi8(eq) & 0xFFFF;
+        mask[i / 8] = bits;
+        mask[i / 8 + 1] = bits >> 8;
+        changed += __builtin_popcount(bits);
+    }
+#endif
+
+    for (; i < count; i += 8) {
+        unsigned int end = i + 8 < count ? i + 8 : count;
+        uint8_t bits = 0;
+        unsigned int j;
+        for (j = i; j < end; ++j) {
+            if (a[j] != b[j]) {
+                bits |= 1 << (j - i);
+                ++changed;
+            }
+        }
+        mask[i / 8] = bits;
+    }
+
+    return changed;
+}
+
+static struct gudp_delta * get_delta(struct gudp_socket * socket, struct gudp_address address, int create) {
+
+    struct gudp_peer * peer = gudp_peer_get(socket, address, create);
+    if (peer == NULL) {
+        return NULL;
+    }
+
+    if (peer->delta == NULL && create) {
+        peer->delta = calloc(1, sizeof(*peer->delta));
+        if (peer->delta == NULL) {
+            PRINT_ERROR_ALLOC_FAILED("calloc");
+            return NULL;
+        }
+        peer->delta->interval = socket->delta.interval;
+    }
+
+    if (peer->delta == NULL || peer->delta->interval == 0) {
+        return NULL;
+    }
+
+    return peer->delta;
+}
+
+int gudp_delta_encode(struct gudp_socket * socket, const void * buf, unsigned int count, struct gudp_address address,
+        const uint8_t ** out) {
+
+    struct gudp_peer * peer = gudp_peer_get(socket, address, 0);
+    struct gudp_delta * delta = peer != NULL ? peer->delta : NULL;
+
+    if (delta == NULL && socket->delta.interval) {
+        // the receiver expects delta frames: never fall back to sending the payload as is
+        delta = get_delta(socket, address, 1);
+        if (delta == NULL) {
+            PRINT_ERROR_OTHER("failed to create the delta state of the peer");
+            return -1;
+        }
+    }
+
+    if (delta == NULL || delta->interval == 0) {
+        *out = buf;
+        return count;
+    }
+
+    if (count + HEADER_SIZE > sizeof(socket->delta.out)) {
+        if (!socket->fragment.config.max_message) {
+            // the receiver would truncate the frame
+            PRINT_ERROR_OTHER("payload is too large for delta encoding without fragmentation");
+            return -1;
+        }
+        if (socket->delta.raw_size < count + HEADER_SIZE) {
+            void * ptr = realloc(socket->delta.raw, count + HEADER_SIZE);
+            if (ptr == NULL) {
+                PRINT_ERROR_ALLOC_FAILED("realloc");
+                return -1;
+            }
+            socket->delta.raw = ptr;
+            socket->delta.raw_size = count + HEADER_SIZE;
+        }
+        socket->delta.raw[0] = FRAME_RAW;
+        socket->delta.raw[1] = 0;
+        memcpy(socket->delta.raw + HEADER_SIZE, buf, count);
+        *out = socket->delta.raw;
+        return HEADER_SIZE + count;
+    }
+
+    uint8_t * frame = socket->delta.out;
+
+    if (delta->tx.count == count && delta->tx.sent < delta->interval) {
+        uint8_t * mask = frame + HEADER_SIZE;
+        unsigned int changed = diff_mask(buf, delta->tx.state, count, mask);
+        unsigned int length = HEADER_SIZE + MASK_SIZE(count) + changed;
+        if (length < HEADER_SIZE + count) {
+            frame[0] = FRAME_DELTA;
+            frame[1] = delta->tx.id;
+            uint8_t * xor = mask + MASK_SIZE(count);
+            const uint8_t * state = buf;
+            unsigned int i;
+            for (i = 0; i < MASK_SIZE(count); ++i) {
+                unsigned int bits = mask[i];
+                while (bits) {
+                    unsigned int j = i * 8 + __builtin_ctz(bits);
+                    *(xor++) = state[j] ^ delta->tx.state[j];
+                    bits &= bits - 1;
+                }
+            }
+            ++delta->tx.sent;
+            *out = frame;
+            return length;
+        }
+    }
+
+    // send a keyframe, which becomes the new reference
+    ++delta->tx.id;
+    frame[0] = FRAME_KEYFRAME;
+    frame[1] = delta->tx.id;
+    memcpy(frame + HEADER_SIZE, buf, count);
+    memcpy(delta->tx.state, buf, count);
+    delta->tx.count = count;
+    delta->tx.sent = 0;
+
+    *out = frame;
+    return HEADER_SIZE + count;
+}
+
+int gudp_delta_decode(struct gudp_socket * socket, const uint8_t * frame, int count, struct gudp_address address,
+        uint8_t * out, const uint8_t ** state) {
+
+    struct gudp_peer * peer = gudp_peer_get(socket, address, 0);
+    struct gudp_delta * delta = peer != NULL ? peer->delta : NULL;
+
+    if (delta == NULL && !socket->delta.interval) {
+        *state = frame;
+        return count;
+    }
+
+    if (delta != NULL && delta->interval == 0) {
+        *state = frame;
+        return count;
+    }
+
+    if (count < HEADER_SIZE) {
+        return -1;
+    }
+
+    if (frame[0] == FRAME_RAW) {
+        *state = frame + HEADER_SIZE;
+        return count - HEADER_SIZE;
+    }
+
+    if (count - HEADER_SIZE > (int) sizeof(delta->rx.state)) {
+        return -1;
+    }
+
+    if (delta == NULL) {
+        // receive state is only created for a keyframe, so that any source cannot make the socket allocate memory
+        if (frame[0] != FRAME_KEYFRAME || (delta = get_delta(socket, address, 1)) == NULL) {
+            return -1;
+        }
+    }
+
+    switch (frame[0]) {
+    case FRAME_KEYFRAME:
+        delta->rx.count = count - HEADER_SIZE;
+        delta->rx.id = frame[1];
+        delta->rx.valid = 1;
+        memcpy(delta->rx.state, frame + HEADER_SIZE, delta->rx.count);
+        *state = delta->rx.state;
+        return delta->rx.count;
+    case FRAME_DELTA:
+        break;
+    default:
+        return -1;
+    }
+
+    // the reference keyframe was lost
+    if (!delta->rx.valid || frame[1] != delta->rx.id) {
+        return -1;
+    }
+
+    unsigned int length = delta->rx.count;
+    const uint8_t * mask = frame + HEADER_SIZE;
+    const uint8_t * xor = mask + MASK_SIZE(length);
+    const uint8_t * end = frame + count;
+    if (xor > end) {
+        return -1;
+    }
+
+    // validate the whole frame before touching out, which may hold the previous state
+    unsigned int changed = 0;
+    unsigned int i;
+    for (i = 0; i < MASK_SIZE(length); ++i) {
+        changed += __builtin_popcount(mask[i]);
+    }
+    if ((length % 8 && mask[length / 8] >> (length % 8)) || changed != (unsigned int) (end - xor)) {
+        return -1;
+    }
+
+    memcpy(out, delta->rx.state, length);
+    for (i = 0; i < MASK_SIZE(length); ++i) {
+        unsigned int bits = mask[i];
+        while (bits) {
+            unsigned int j = i * 8 + __builtin_ctz(bits);
+            out[j] ^= *(xor++);
+            bits &= bits - 1;
+        }
+    }
+
+    *state = out;
+    return length;
+}
+
+int gudp_set_delta(struct gudp_socket * socket, const struct gudp_address * address, unsigned int interval) {
+
+    if (interval) {
+        socket->delta.used = 1;
+    }
+
+    if (address == NULL) {
+        socket->delta.interval = interval;
+        return 0;
+    }
+
+    struct gudp_peer * peer = gudp_peer_get(socket, *address, 1);
+    if (peer == NULL) {
+        return -1;
+    }
+
+    if (peer->delta == NULL) {
+        peer->delta = calloc(1, sizeof(*peer->delta));
+        if (peer->delta == NULL) {
+            PRINT_ERROR_ALLOC_FAILED("calloc");
+            return -1;
+        }
+    }
+
+    peer->delta->interval = interval;
+    // force a keyframe
+    peer->delta->tx.count = 0;
+
+    return 0;
+}
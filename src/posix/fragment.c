@@ -0,0 +1,266 @@
+/*
+ Copyright (c) 2020 Mathieu Laurendeau <mat.lau@laposte.net>
+ License: GPLv3
+ */
+
+#include <src/gudp_internal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gimxcommon/include/gerror.h>
+
+/*
+ * Fragment layout, multi-byte fields in network byte order:
+ * magic (2), id (2), index (1), total (1), fragment size (2), payload
+ * All fragments but the last one carry exactly fragment size bytes, so that each payload
+ * can be stored at its final offset in the reassembly buffer as soon as it is received.
+ */
+#define FRAGMENT_MAGIC0 'G'
+#define FRAGMENT_MAGIC1 'F'
+
+#define HEADER_SIZE 8
+
+#define DEFAULT_TIMEOUT 1000 // milliseconds
+#define DEFAULT_SLOTS 2
+#define DEFAULT_MEMORY (4 * 1024 * 1024)
+
+static int is_fragment(const uint8_t * buf, unsigned int count) {
+
+    return count >= HEADER_SIZE && buf[0] == FRAGMENT_MAGIC0 && buf[1] == FRAGMENT_MAGIC1;
+}
+
+int gudp_fragment_send(struct gudp_socket * socket, const void * buf, unsigned int count, struct gudp_address address) {
+
+    const struct gudp_fragmentation * config = &socket->fragment.config;
+
+    // a single datagram that could be mistaken for a fragment is sent as a single fragment
+    if (count <= config->fragment_size && !is_fragment(buf, count)) {
+        return gudp_send_frame(socket, buf, count, address, 1);
+    }
+
+    if (count > config->max_message) {
+        PRINT_ERROR_OTHER("message is too large");
+        return -1;
+    }
+
+    unsigned int total = count ? (count + config->fragment_size - 1) / config->fragment_size : 1;
+    uint16_t id = socket->fragment.id++;
+
+    uint8_t * fragment = socket->fragment.out;
+    fragment[0] = FRAGMENT_MAGIC0;
+    fragment[1] = FRAGMENT_MAGIC1;
+    fragment[2] = id >> 8;
+    fragment[3] = id;
+    fragment[5] = total;
+    fragment[6] = config->fragment_size >> 8;
+    fragment[7] = config->fragment_size;
+
+    unsigned int index;
+    for (index = 0; index < total; ++index) {
+        unsigned int offset = index * config->fragment_size;
+        unsigned int length = count - offset < config->fragment_size ? count - offset : config->fragment_size;
+        fragment[4] = index;
+        memcpy(fragment + HEADER_SIZE, (const uint8_t *) buf + offset, length);
+        if (gudp_send_frame(socket, fragment, HEADER_SIZE + length, address, 1) < 0) {
+            return -1;
+        }
+    }
+
+    return count;
+}
+
+static size_t slots_memory(struct gudp_socket * socket) {
+
+    return (size_t) socket->fragment.config.slots * socket->fragment.config.max_message;
+}
+
+static int alloc_slots(struct gudp_socket * socket, struct gudp_peer * peer) {
+
+    const struct gudp_fragmentation * config = &socket->fragment.config;
+
+    peer->fragments = calloc(config->slots, sizeof(*peer->fragments));
+    if (peer->fragments == NULL) {
+        PRINT_ERROR_ALLOC_FAILED("calloc");
+        return -1;
+    }
+
+    unsigned int i;
+    for (i = 0; i < config->slots; ++i) {
+        peer->fragments[i].buffer = malloc(config->max_message);
+        if (peer->fragments[i].buffer == NULL) {
+            PRINT_ERROR_ALLOC_FAILED("malloc");
+            gudp_fragment_clean(socket, peer);
+            return -1;
+        }
+    }
+    peer->nb_fragments = config->slots;
+    socket->fragment.memory += slots_memory(socket);
+
+    return 0;
+}
+
+/*
+ * Get the slot reassembling a message: the one with the same id, or a free one, or the oldest one.
+ * Incomplete messages that timed out are discarded first.
+ */
+static struct gudp_fragment_slot * get_slot(struct gudp_socket * socket, struct gudp_peer * peer, uint16_t id,
+        uint64_t now) {
+
+    uint64_t timeout = (uint64_t) socket->fragment.config.timeout * 1000000ULL;
+    struct gudp_fragment_slot * candidate = NULL;
+
+    unsigned int i;
+    for (i = 0; i < peer->nb_fragments; ++i) {
+        struct gudp_fragment_slot * slot = peer->fragments + i;
+        if (slot->busy && now - slot->first > timeout) {
+            slot->busy = 0;
+        }
+        if (slot->busy && slot->id == id) {
+            return slot;
+        }
+        if (candidate == NULL || (candidate->busy && (!slot->busy || slot->first < candidate->first))) {
+            candidate = slot;
+        }
+    }
+
+    if (candidate == NULL) {
+        return NULL;
+    }
+
+    memset(candidate->received, 0x00, sizeof(candidate->received));
+    candidate->nb_received = 0;
+    candidate->length = 0;
+    candidate->id = id;
+    candidate->first = now;
+    candidate->busy = 1;
+
+    return candidate;
+}
+
+int gudp_fragment_process(struct gudp_socket * socket, const uint8_t * buf, unsigned int count,
+        struct gudp_address address, struct gudp_fragment_slot ** result) {
+
+    *result = NULL;
+
+    if (!is_fragment(buf, count)) {
+        return count;
+    }
+
+    uint16_t id = buf[2] << 8 | buf[3];
+    unsigned int index = buf[4];
+    unsigned int total = buf[5];
+    unsigned int size = buf[6] << 8 | buf[7];
+    unsigned int length = count - HEADER_SIZE;
+
+    if (total == 0 || index >= total || size == 0 || (size_t) total * size > socket->fragment.config.max_message + size - 1
+            || (index + 1 < total && length != size) || length > size) {
+        return 0;
+    }
+
+    struct gudp_peer * peer = gudp_peer_get(socket, address, 0);
+    if (peer == NULL || peer->fragments == NULL) {
+        // check the memory budget before creating any state, and drop fragments from this peer if exceeded
+        if (socket->fragment.memory + slots_memory(socket) > socket->fragment.config.max_memory) {
+            return 0;
+        }
+        if (peer == NULL && (peer = gudp_peer_get(socket, address, 1)) == NULL) {
+            return 0;
+        }
+        if (alloc_slots(socket, peer) < 0) {
+            return 0;
+        }
+    }
+
+    uint64_t now = gudp_time_ns();
+
+    struct gudp_fragment_slot * slot = get_slot(socket, peer, id, now);
+    if (slot == NULL) {
+        return 0;
+    }
+
+    unsigned int offset = index * size;
+    if (offset + length > socket->fragment.config.max_message) {
+        slot->busy = 0;
+        return 0;
+    }
+
+    if (slot->received[index / 8] & (1 << (index % 8))) {
+        // duplicate
+        return 0;
+    }
+
+    if (slot->nb_received == 0) {
+        slot->total = total;
+        slot->size = size;
+    } else if (slot->total != total || slot->size != size) {
+        return 0;
+    }
+
+    memcpy(slot->buffer + offset, buf + HEADER_SIZE, length);
+    slot->received[index / 8] |= 1 << (index % 8);
+    ++slot->nb_received;
+    if (index + 1 == total) {
+        slot->length = offset + length;
+    }
+
+    if (slot->nb_received < slot->total) {
+        return 0;
+    }
+
+    *result = slot;
+    return slot->length;
+}
+
+void gudp_fragment_release(struct gudp_fragment_slot * slot) {
+
+    slot->busy = 0;
+}
+
+void gudp_fragment_clean(struct gudp_socket * socket, struct gudp_peer * peer) {
+
+    if (peer->fragments == NULL) {
+        return;
+    }
+
+    unsigned int i;
+    for (i = 0; i < socket->fragment.config.slots; ++i) {
+        free(peer->fragments[i].buffer);
+    }
+    free(peer->fragments);
+    peer->fragments = NULL;
+    if (peer->nb_fragments) {
+        socket->fragment.memory -= (size_t) peer->nb_fragments * socket->fragment.config.max_message;
+        peer->nb_fragments = 0;
+    }
+}
+
+int gudp_set_fragmentation(struct gudp_socket * socket, const struct gudp_fragmentation * config) {
+
+    struct gudp_fragmentation fragmentation = *config;
+
+    if (fragmentation.fragment_size == 0 || fragmentation.fragment_size > GUDP_DATAGRAM_MAX - HEADER_SIZE) {
+        fragmentation.fragment_size = GUDP_DATAGRAM_MAX - HEADER_SIZE;
+    }
+    if (fragmentation.max_message > GUDP_FRAGMENTS_MAX * fragmentation.fragment_size) {
+        PRINT_ERROR_OTHER("max_message is too large for the fragment size");
+        return -1;
+    }
+    if (fragmentation.timeout == 0) {
+        fragmentation.timeout = DEFAULT_TIMEOUT;
+    }
+    if (fragmentation.slots == 0) {
+        fragmentation.slots = DEFAULT_SLOTS;
+    }
+    if (fragmentation.max_memory == 0) {
+        fragmentation.max_memory = DEFAULT_MEMORY;
+    }
+
+    // reassembly slots are sized for the previous configuration
+    unsigned int i;
+    for (i = 0; i < socket->nb_peers; ++i) {
+        gudp_fragment_clean(socket, socket->peers[i]);
+    }
+
+    socket->fragment.config = fragmentation;
+
+    return 0;
+}
@@ -3,10 +3,12 @@
  License: GPLv3
  */
 
-#include <gudp.h>
+#include <src/gudp_internal.h>
 #ifndef WIN32
 #include <arpa/inet.h>
 #include <errno.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
 #else
 #include <src/windows/sockets.h>
 #endif
@@ -44,14 +46,6 @@ GLOG_INST(GLOG_NAME)
     } while (0)
 #endif
 
-struct gudp_socket {
-    int fd;
-    enum gudp_mode mode;
-    GUDP_CALLBACKS callbacks;
-    void * user;
-    uint8_t buffer[1472];
-};
-
 int gudp_parse_address(const char * cp, struct gudp_address * address) {
 
     int ret = 0;
@@ -147,6 +141,11 @@ struct gudp_socket * gudp_open(enum gudp_mode mode, struct gudp_address address)
         if (s != NULL) {
             s->fd = fd;
             s->mode = mode;
+            s->pacing.timer = -1;
+            s->periodic.timer = -1;
+#ifdef GUDP_IMPAIRMENT
+            s->impairment.timer = -1;
+#endif
         } else {
             PRINT_ERROR_ALLOC_FAILED("calloc");
             error = 1;
@@ -164,18 +163,84 @@ struct gudp_socket * gudp_open(enum gudp_mode mode, struct gudp_address address)
     return s;
 }
 
-int gudp_send(struct gudp_socket * socket, const void * buf, unsigned int count, struct gudp_address address) {
+static inline unsigned int peer_hash(struct gudp_address address) {
 
-    if (!address.ip || !address.port) {
-        PRINT_ERROR_OTHER("ip and port should not be 0");
-        return -1;
+    // Fibonacci hashing of the address, keeping the top bits
+    uint32_t key = address.ip ^ ((uint32_t) address.port << 16 | address.port);
+    return (key * 2654435761U) >> (32 - GUDP_PEERS_HASH_BITS);
+}
+
+struct gudp_peer * gudp_peer_get(struct gudp_socket * socket, struct gudp_address address, int create) {
+
+    unsigned int hash = peer_hash(address);
+
+    struct gudp_peer * peer;
+    for (peer = socket->buckets[hash]; peer != NULL; peer = peer->next) {
+        if (peer->address.ip == address.ip && peer->address.port == address.port) {
+            return peer;
+        }
+    }
+
+    // datagrams from any source may create a state: bound the table
+    if (!create || socket->nb_peers == GUDP_PEERS_MAX) {
+        return NULL;
     }
 
+    peer = calloc(1, sizeof(*peer));
+    if (peer == NULL) {
+        PRINT_ERROR_ALLOC_FAILED("calloc");
+        return NULL;
+    }
+
+    void * ptr = realloc(socket->peers, (socket->nb_peers + 1) * sizeof(*socket->peers));
+    if (ptr == NULL) {
+        PRINT_ERROR_ALLOC_FAILED("realloc");
+        free(peer);
+        return NULL;
+    }
+
+    socket->peers = ptr;
+    socket->peers[socket->nb_peers++] = peer;
+    peer->address = address;
+    peer->next = socket->buckets[hash];
+    socket->buckets[hash] = peer;
+
+    return peer;
+}
+
+int gudp_sendto(struct gudp_socket * socket, const void * buf, unsigned int count, struct gudp_address address,
+        uint64_t txtime) {
+
     struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons(address.port), .sin_addr.s_addr = address.ip };
 
     dprintf("send %d bytes to %s:%hu\n", count, gudp_ip_str(address.ip), address.port);
 
-    int ret = sendto(socket->fd, buf, count, MSG_DONTWAIT, (struct sockaddr *) &sa, sizeof(sa));
+    int ret;
+#if !defined(WIN32) && defined(SCM_TXTIME)
+    if (txtime) {
+        struct iovec iov = { .iov_base = (void *) buf, .iov_len = count };
+        uint8_t control[CMSG_SPACE(sizeof(txtime))] = {};
+        struct msghdr msg = {
+                .msg_name = &sa,
+                .msg_namelen = sizeof(sa),
+                .msg_iov = &iov,
+                .msg_iovlen = 1,
+                .msg_control = control,
+                .msg_controllen = sizeof(control),
+        };
+        struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_TXTIME;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(txtime));
+        memcpy(CMSG_DATA(cmsg), &txtime, sizeof(txtime));
+        ret = sendmsg(socket->fd, &msg, MSG_DONTWAIT);
+    } else
+#else
+    (void) txtime;
+#endif
+    {
+        ret = sendto(socket->fd, buf, count, MSG_DONTWAIT, (struct sockaddr *) &sa, sizeof(sa));
+    }
     if (ret < 0) {
         PRINT_SOCKET_ERROR("sendto");
     }
@@ -183,6 +248,67 @@ int gudp_send(struct gudp_socket * socket, const void * buf, unsigned int count,
     return ret;
 }
 
+int gudp_send_datagram(struct gudp_socket * socket, const void * buf, unsigned int count,
+        struct gudp_address address, int paced) {
+
+    if (paced && gudp_pacing_enabled(socket)) {
+        return gudp_pacing_send(socket, buf, count, address);
+    }
+
+    return gudp_sendto(socket, buf, count, address, 0);
+}
+
+int gudp_send_frame(struct gudp_socket * socket, const void * buf, unsigned int count, struct gudp_address address,
+        int paced) {
+
+#ifdef GUDP_IMPAIRMENT
+    if (socket->impairment.stages[GUDP_DIRECTION_OUT] != NULL) {
+        int copies = gudp_impairment_process(socket, GUDP_DIRECTION_OUT, buf, count, address, paced);
+        if (copies < 0) {
+            return -1;
+        }
+        while (copies-- > 0) {
+            if (gudp_send_datagram(socket, buf, count, address, paced) < 0) {
+                return -1;
+            }
+        }
+        return count;
+    }
+#endif
+
+    return gudp_send_datagram(socket, buf, count, address, paced);
+}
+
+int gudp_send(struct gudp_socket * socket, const void * buf, unsigned int count, struct gudp_address address) {
+
+    if (!address.ip || !address.port) {
+        PRINT_ERROR_OTHER("ip and port should not be 0");
+        return -1;
+    }
+
+    if (socket->capture.header != NULL) {
+        gudp_capture(socket, GUDP_DIRECTION_OUT, buf, count, address);
+    }
+
+    const uint8_t * frame = buf;
+    int length = count;
+    if (socket->delta.used) {
+        length = gudp_delta_encode(socket, buf, count, address, &frame);
+        if (length < 0) {
+            return -1;
+        }
+    }
+
+    int ret;
+    if (socket->fragment.config.max_message) {
+        ret = gudp_fragment_send(socket, frame, length, address);
+    } else {
+        ret = gudp_send_frame(socket, frame, length, address, 1);
+    }
+
+    return ret < 0 ? ret : (int) count;
+}
+
 int gudp_recv(struct gudp_socket * socket, void * buf, unsigned int count, unsigned int timeout,
         struct gudp_address * address) {
 
@@ -235,15 +361,84 @@ int gudp_recv(struct gudp_socket * socket, void * buf, unsigned int count, unsig
     return ret;
 }
 
+int gudp_read(struct gudp_socket * socket, const void * buf, int count, struct gudp_address address) {
+
+    if (count >= 0 && socket->capture.header != NULL) {
+        gudp_capture(socket, GUDP_DIRECTION_IN, buf, count, address);
+    }
+
+    return socket->callbacks.fp_read(socket->user, buf, count, address);
+}
+
+int gudp_deliver(struct gudp_socket * socket, const uint8_t * buf, int count, struct gudp_address address) {
+
+    if (count > 0 && socket->clock && gudp_clock_process(socket, buf, count, address)) {
+        return 0;
+    }
+
+    struct gudp_fragment_slot * slot = NULL;
+    if (count > 0 && socket->fragment.config.max_message) {
+        int length = gudp_fragment_process(socket, buf, count, address, &slot);
+        if (length == 0) {
+            // message is incomplete
+            return 0;
+        }
+        if (slot != NULL) {
+            buf = slot->buffer;
+            count = length;
+        }
+    }
+
+    int status = 0;
+    if (count >= 0 && socket->delta.used) {
+        count = gudp_delta_decode(socket, buf, count, address, socket->delta.in, &buf);
+        if (count < 0) {
+            // cannot be decoded until the next keyframe
+            buf = NULL;
+        }
+    }
+
+    // the read callback may close the socket: the slot must not be touched afterwards
+    if (slot != NULL) {
+        gudp_fragment_release(slot);
+    }
+
+    if (buf != NULL) {
+        status = gudp_read(socket, buf, count, address);
+    }
+
+    return status;
+}
+
 static int read_callback(void * user) {
 
     struct gudp_socket * socket = (struct gudp_socket *) user;
 
+#ifndef WIN32
+    if (socket->latest.enabled) {
+        return gudp_latest_read(socket);
+    }
+#endif
+
     struct gudp_address address;
 
     int ret = gudp_recv(socket, socket->buffer, sizeof(socket->buffer), 0, &address);
 
-    return socket->callbacks.fp_read(socket->user, socket->buffer, ret, address);
+#ifdef GUDP_IMPAIRMENT
+    if (ret >= 0 && socket->impairment.stages[GUDP_DIRECTION_IN] != NULL) {
+        int copies = gudp_impairment_process(socket, GUDP_DIRECTION_IN, socket->buffer, ret, address, 0);
+        int status = 0;
+        while (copies-- > 0 && status >= 0) {
+            int result = gudp_deliver(socket, socket->buffer, ret, address);
+            if (result) {
+                status = result;
+            }
+        }
+        return status;
+    }
+#endif
+
+    return gudp_deliver(socket, socket->buffer, ret, address);
 }
 
 static int close_callback(void * user) {
@@ -253,6 +448,73 @@ static int close_callback(void * user) {
     return socket->callbacks.fp_close(socket->user);
 }
 
+#ifndef WIN32
+
+int gudp_timer_open(struct gudp_socket * socket, GPOLL_READ_CALLBACK fp_read, int * fd) {
+
+    if (socket->callbacks.fp_register == NULL) {
+        PRINT_ERROR_OTHER("the socket is not registered");
+        return -1;
+    }
+
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tfd < 0) {
+        PRINT_ERROR_ERRNO("timerfd_create");
+        return -1;
+    }
+
+    GPOLL_CALLBACKS callbacks = {
+            .fp_read = fp_read,
+            .fp_write = NULL,
+            .fp_close = close_callback,
+    };
+
+    if (socket->callbacks.fp_register(tfd, socket, &callbacks) < 0) {
+        close(tfd);
+        return -1;
+    }
+
+    *fd = tfd;
+
+    return 0;
+}
+
+int gudp_timer_arm(int fd, uint64_t deadline) {
+
+    struct itimerspec its = { };
+    its.it_value.tv_sec = deadline / 1000000000ULL;
+    its.it_value.tv_nsec = deadline % 1000000000ULL;
+    if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        PRINT_ERROR_ERRNO("timerfd_settime");
+        return -1;
+    }
+    return 0;
+}
+
+int gudp_timer_read(int fd) {
+
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        PRINT_ERROR_ERRNO("read");
+        return -1;
+    }
+    return 0;
+}
+
+void gudp_timer_close(struct gudp_socket * socket, int * fd) {
+
+    if (*fd < 0) {
+        return;
+    }
+    if (socket->callbacks.fp_remove != NULL) {
+        socket->callbacks.fp_remove(*fd);
+    }
+    close(*fd);
+    *fd = -1;
+}
+
+#endif
+
 int gudp_register(struct gudp_socket * socket, void * user, const GUDP_CALLBACKS * callbacks) {
 
     if (callbacks->fp_register == NULL) {
@@ -287,6 +549,29 @@ int gudp_register(struct gudp_socket * socket, void * user, const GUDP_CALLBACKS
 
 int gudp_close(struct gudp_socket * socket) {
 
+    gudp_periodic_stop(socket);
+#ifdef GUDP_IMPAIRMENT
+    gudp_impairment_clean(socket);
+#endif
+    gudp_pacing_clean(socket);
+    gudp_capture_stop(socket);
+    gudp_latest_clean(socket);
+
+    unsigned int i;
+    for (i = 0; i < socket->nb_peers; ++i) {
+        gudp_fragment_clean(socket, socket->peers[i]);
+        free(socket->peers[i]->delta);
+        free(socket->peers[i]);
+    }
+    free(socket->peers);
+    socket->peers = NULL;
+    socket->nb_peers = 0;
+    memset(socket->buckets, 0x00, sizeof(socket->buckets));
+
+    free(socket->delta.raw);
+    socket->delta.raw = NULL;
+    socket->delta.raw_size = 0;
+
     if (socket->fd >= 0) {
         if (socket->callbacks.fp_remove != NULL) {
             socket->callbacks.fp_remove(socket->fd);
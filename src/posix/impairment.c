@@ -0,0 +1,328 @@
+/*
+ Copyright (c) 2020 Mathieu Laurendeau <mat.lau@laposte.net>
+ License: GPLv3
+ */
+
+#include <src/gudp_internal.h>
+#ifdef GUDP_IMPAIRMENT
+#include <stdlib.h>
+#include <string.h>
+#endif
+#include <gimxcommon/include/gerror.h>
+
+#ifdef GUDP_IMPAIRMENT
+
+#define WHEEL_TICK 10000ULL // nanoseconds
+
+#define IMPAIRMENT_QUEUE_MAX 4096 // maximum number of delayed packets
+
+/*
+ * splitmix64: the sequence only depends on the seed, on all platforms.
+ */
+static double random_unit(struct gudp_impairment_stage * stage) {
+
+    uint64_t z = (stage->random += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    return (z >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int is_used(struct gudp_socket * socket, unsigned int slot) {
+
+    return (socket->impairment.used[slot / 64] >> (slot % 64)) & 1;
+}
+
+static void set_used(struct gudp_socket * socket, unsigned int slot, int used) {
+
+    if (used) {
+        socket->impairment.used[slot / 64] |= 1ULL << (slot % 64);
+    } else {
+        socket->impairment.used[slot / 64] &= ~(1ULL << (slot % 64));
+    }
+}
+
+/*
+ * Get the first tick after the last processed one that has a non-empty slot.
+ * Slots may hold packets for later revolutions, so this is only a lower bound of the next release.
+ */
+static uint64_t next_tick(struct gudp_socket * socket) {
+
+    uint64_t tick = socket->impairment.tick + 1;
+    unsigned int scanned = 0;
+    while (scanned < GUDP_WHEEL_SLOTS) {
+        unsigned int slot = tick % GUDP_WHEEL_SLOTS;
+        uint64_t word = socket->impairment.used[slot / 64] >> (slot % 64);
+        if (word) {
+            return tick + __builtin_ctzll(word);
+        }
+        tick += 64 - slot % 64;
+        scanned += 64 - slot % 64;
+    }
+    return tick;
+}
+
+static int arm_timer(struct gudp_socket * socket) {
+
+    socket->impairment.armed = socket->impairment.queued ? next_tick(socket) : 0;
+    return gudp_timer_arm(socket->impairment.timer, socket->impairment.armed * WHEEL_TICK);
+}
+
+static int release_packet(struct gudp_socket * socket, struct gudp_impaired_packet * packet) {
+
+    int ret = 0;
+    if (packet->direction == GUDP_DIRECTION_OUT) {
+        gudp_send_datagram(socket, packet->data, packet->count, packet->address, packet->paced);
+    } else {
+        ret = gudp_deliver(socket, packet->data, packet->count, packet->address);
+    }
+    free(packet);
+    return ret;
+}
+
+/*
+ * Release the packets that are due, in release time order.
+ * Returns the first negative or the last non-zero value returned by the read callback.
+ */
+static int advance(struct gudp_socket * socket, uint64_t now) {
+
+    uint64_t target = now / WHEEL_TICK;
+    int status = 0;
+
+    unsigned int steps;
+    for (steps = 0; socket->impairment.tick < target && steps < GUDP_WHEEL_SLOTS; ++steps) {
+        // packets queued from a callback are released at a later tick
+        uint64_t tick = ++socket->impairment.tick;
+        unsigned int slot = tick % GUDP_WHEEL_SLOTS;
+        if (!is_used(socket, slot)) {
+            continue;
+        }
+        struct gudp_impaired_packet * packet;
+        while ((packet = socket->impairment.wheel[slot]) != NULL && packet->tick <= target) {
+            socket->impairment.wheel[slot] = packet->next;
+            set_used(socket, slot, packet->next != NULL);
+            --socket->impairment.queued;
+            int ret = release_packet(socket, packet);
+            if (ret && status >= 0) {
+                status = ret;
+            }
+        }
+    }
+    socket->impairment.tick = target;
+
+    if (arm_timer(socket) < 0 && status == 0) {
+        status = -1;
+    }
+
+    return status;
+}
+
+static int timer_read(void * user) {
+
+    struct gudp_socket * socket = (struct gudp_socket *) user;
+
+    if (gudp_timer_read(socket->impairment.timer) < 0) {
+        return -1;
+    }
+
+    return advance(socket, gudp_time_ns());
+}
+
+static int enqueue(struct gudp_socket * socket, enum gudp_direction direction, int paced, const void * buf,
+        unsigned int count, struct gudp_address address, uint64_t now, uint64_t release) {
+
+    if (socket->impairment.timer < 0 && gudp_timer_open(socket, timer_read, &socket->impairment.timer) < 0) {
+        return -1;
+    }
+
+    struct gudp_impaired_packet * packet = malloc(sizeof(*packet) + count);
+    if (packet == NULL) {
+        PRINT_ERROR_ALLOC_FAILED("malloc");
+        return -1;
+    }
+
+    if (socket->impairment.queued == 0) {
+        socket->impairment.tick = now / WHEEL_TICK;
+    }
+
+    packet->release = release;
+    // never release a packet early
+    packet->tick = (release + WHEEL_TICK - 1) / WHEEL_TICK;
+    if (packet->tick <= socket->impairment.tick) {
+        packet->tick = socket->impairment.tick + 1;
+    }
+    packet->direction = direction;
+    packet->paced = paced;
+    packet->address = address;
+    packet->count = count;
+    memcpy(packet->data, buf, count);
+
+    // keep each slot sorted by release time, and packets with the same release time in arrival order
+    unsigned int slot = packet->tick % GUDP_WHEEL_SLOTS;
+    struct gudp_impaired_packet ** prev = &socket->impairment.wheel[slot];
+    while (*prev != NULL && (*prev)->release <= release) {
+        prev = &(*prev)->next;
+    }
+    packet->next = *prev;
+    *prev = packet;
+    set_used(socket, slot, 1);
+    ++socket->impairment.queued;
+
+    if (socket->impairment.armed && socket->impairment.armed <= packet->tick) {
+        return 0;
+    }
+
+    return arm_timer(socket);
+}
+
+int gudp_impairment_process(struct gudp_socket * socket, enum gudp_direction direction, const void * buf,
+        unsigned int count, struct gudp_address address, int paced) {
+
+    struct gudp_impairment_stage * stage = socket->impairment.stages[direction];
+    const struct gudp_impairment * config = &stage->config;
+
+    uint64_t now = gudp_time_ns();
+
+    ++stage->stats.packets;
+
+    // always draw the same variables, so that enabling an impairment does not change the pattern of the others
+    double transition = random_unit(stage);
+    double loss = random_unit(stage);
+    double reorder = random_unit(stage);
+    double duplicate = random_unit(stage);
+    double jitter[2] = { random_unit(stage), random_unit(stage) };
+
+    if (config->burst_enter > 0) {
+        if (!stage->bad && transition < config->burst_enter) {
+            stage->bad = 1;
+        } else if (stage->bad && transition < config->burst_exit) {
+            stage->bad = 0;
+        }
+    }
+
+    if (loss < (stage->bad ? config->burst_loss : config->loss)) {
+        ++stage->stats.lost;
+        return 0;
+    }
+
+    unsigned int copies = 1;
+    if (duplicate < config->duplicate) {
+        ++stage->stats.duplicated;
+        copies = 2;
+    }
+
+    int reordered = reorder < config->reorder;
+    if (reordered) {
+        ++stage->stats.reordered;
+    }
+
+    int immediate = 0;
+
+    unsigned int i;
+    for (i = 0; i < copies; ++i) {
+        uint64_t release = now;
+        if (config->rate) {
+            // serialization on the emulated link
+            uint64_t start = stage->link > now ? stage->link : now;
+            stage->link = start + (uint64_t) count * 1000000000ULL / config->rate;
+            release = stage->link;
+        }
+        if (!reordered) {
+            release += (uint64_t) config->delay * 1000 + (uint64_t) (jitter[i] * config->jitter * 1000.0);
+        }
+        if (release <= now) {
+            ++immediate;
+        } else if (socket->impairment.queued == IMPAIRMENT_QUEUE_MAX) {
+            ++stage->stats.overflows;
+        } else if (enqueue(socket, direction, paced, buf, count, address, now, release) < 0) {
+            return -1;
+        }
+    }
+
+    return immediate;
+}
+
+void gudp_impairment_clean(struct gudp_socket * socket) {
+
+    gudp_timer_close(socket, &socket->impairment.timer);
+
+    unsigned int i;
+    for (i = 0; i < GUDP_WHEEL_SLOTS; ++i) {
+        while (socket->impairment.wheel[i] != NULL) {
+            struct gudp_impaired_packet * packet = socket->impairment.wheel[i];
+            socket->impairment.wheel[i] = packet->next;
+            free(packet);
+        }
+    }
+    memset(socket->impairment.used, 0x00, sizeof(socket->impairment.used));
+    socket->impairment.queued = 0;
+
+    free(socket->impairment.stages[GUDP_DIRECTION_IN]);
+    free(socket->impairment.stages[GUDP_DIRECTION_OUT]);
+    socket->impairment.stages[GUDP_DIRECTION_IN] = NULL;
+    socket->impairment.stages[GUDP_DIRECTION_OUT] = NULL;
+}
+
+#endif
+
+int gudp_set_impairment(struct gudp_socket * socket, enum gudp_direction direction,
+        const struct gudp_impairment * impairment) {
+
+#ifdef GUDP_IMPAIRMENT
+    if (direction != GUDP_DIRECTION_IN && direction != GUDP_DIRECTION_OUT) {
+        PRINT_ERROR_OTHER("invalid direction");
+        return -1;
+    }
+
+    if (impairment == NULL) {
+        // delayed packets are still released
+        free(socket->impairment.stages[direction]);
+        socket->impairment.stages[direction] = NULL;
+        return 0;
+    }
+
+    struct gudp_impairment_stage * stage = socket->impairment.stages[direction];
+    if (stage == NULL) {
+        stage = malloc(sizeof(*stage));
+        if (stage == NULL) {
+            PRINT_ERROR_ALLOC_FAILED("malloc");
+            return -1;
+        }
+        socket->impairment.stages[direction] = stage;
+    }
+
+    memset(stage, 0x00, sizeof(*stage));
+    stage->config = *impairment;
+    stage->random = impairment->seed;
+
+    return 0;
+#else
+    (void) socket;
+    (void) direction;
+    (void) impairment;
+    PRINT_ERROR_OTHER("impairment emulation is not compiled in, build with IMPAIRMENT=1");
+    return -1;
+#endif
+}
+
+int gudp_get_impairment_stats(struct gudp_socket * socket, enum gudp_direction direction,
+        struct gudp_impairment_stats * stats) {
+
+#ifdef GUDP_IMPAIRMENT
+    if ((direction != GUDP_DIRECTION_IN && direction != GUDP_DIRECTION_OUT)
+            || socket->impairment.stages[direction] == NULL) {
+        PRINT_ERROR_OTHER("no impairment for this direction");
+        return -1;
+    }
+
+    *stats = socket->impairment.stages[direction]->stats;
+
+    return 0;
+#else
+    (void) socket;
+    (void) direction;
+    (void) stats;
+    PRINT_ERROR_OTHER("impairment emulation is not compiled in, build with IMPAIRMENT=1");
+    return -1;
+#endif
+}
@@ -0,0 +1,264 @@
+/*
+ Copyright (c) 2020 Mathieu Laurendeau <mat.lau@laposte.net>
+ License: GPLv3
+ */
+
+#ifndef WIN32
+#define _GNU_SOURCE
+#endif
+
+#include <src/gudp_internal.h>
+#ifndef WIN32
+#include <arpa/inet.h>
+#include <errno.h>
+#include <sys/socket.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <gimxcommon/include/gerror.h>
+
+#define LATEST_DRAIN_MAX 4096 // maximum number of datagrams drained per readiness event
+
+#ifndef WIN32
+
+static struct gudp_latest_slot * get_slot(struct gudp_socket * socket, struct gudp_address address) {
+
+    unsigned int i;
+    for (i = 0; i < socket->latest.nb_slots; ++i) {
+        struct gudp_latest_slot * slot = socket->latest.slots + i;
+        if (slot->address.ip == address.ip && slot->address.port == address.port) {
+            return slot;
+        }
+    }
+
+    if (socket->latest.nb_slots == socket->latest.allocated) {
+        unsigned int allocated = socket->latest.allocated ? 2 * socket->latest.allocated : 4;
+        void * ptr = realloc(socket->latest.slots, allocated * sizeof(*socket->latest.slots));
+        if (ptr == NULL) {
+            PRINT_ERROR_ALLOC_FAILED("realloc");
+            return NULL;
+        }
+        socket->latest.slots = ptr;
+        memset(socket->latest.slots + socket->latest.allocated, 0x00,
+                (allocated - socket->latest.allocated) * sizeof(*socket->latest.slots));
+        socket->latest.allocated = allocated;
+    }
+
+    struct gudp_latest_slot * slot = socket->latest.slots + socket->latest.nb_slots;
+    if (slot->buffer == NULL) {
+        slot->buffer = malloc(GUDP_DATAGRAM_MAX);
+        if (slot->buffer == NULL) {
+            PRINT_ERROR_ALLOC_FAILED("malloc");
+            return NULL;
+        }
+    }
+    slot->address = address;
+    slot->superseded = 0;
+    slot->count = -1;
+    ++socket->latest.nb_slots;
+
+    return slot;
+}
+
+/*
+ * Keep the datagram received in a batch buffer as the latest one from its peer.
+ * Buffers are swapped rather than copied: the batch gets back the stale buffer.
+ * Reassembled messages do not fit in a slot buffer: they are passed to the read callback right away,
+ * and its return value is returned.
+ */
+static int keep(struct gudp_socket * socket, unsigned int index, int count, struct gudp_address address) {
+
+    uint8_t * buf = socket->latest.batch[index];
+
+#ifdef GUDP_IMPAIRMENT
+    // duplicates that are not delayed would be superseded anyway
+    if (count >= 0 && socket->impairment.stages[GUDP_DIRECTION_IN] != NULL
+            && gudp_impairment_process(socket, GUDP_DIRECTION_IN, buf, count, address, 0) <= 0) {
+        return 0;
+    }
+#endif
+
+    if (count > 0 && socket->clock && gudp_clock_process(socket, buf, count, address)) {
+        return 0;
+    }
+
+    if (count > 0 && socket->fragment.config.max_message) {
+        struct gudp_fragment_slot * message;
+        int length = gudp_fragment_process(socket, buf, count, address, &message);
+        if (message != NULL) {
+            const uint8_t * payload = message->buffer;
+            if (socket->delta.used) {
+                length = gudp_delta_decode(socket, payload, length, address, socket->delta.in, &payload);
+            }
+            // the read callback may close the socket: the slot must not be touched afterwards
+            gudp_fragment_release(message);
+            return length < 0 ? 0 : gudp_read(socket, payload, length, address);
+        }
+        if (length == 0) {
+            // message is incomplete
+            return 0;
+        }
+    }
+
+    struct gudp_latest_slot * slot = get_slot(socket, address);
+    if (slot == NULL) {
+        return 0;
+    }
+
+    if (count >= 0 && socket->delta.used) {
+        // decode every frame, so that keyframes are never skipped
+        const uint8_t * state;
+        count = gudp_delta_decode(socket, buf, count, address, slot->buffer, &state);
+        if (count < 0) {
+            if (slot->count < 0) {
+                // the slot was just created for this datagram, which is dropped
+                --socket->latest.nb_slots;
+            }
+            return 0;
+        }
+        if (slot->count >= 0) {
+            ++slot->superseded;
+        }
+        slot->count = count;
+        if (state != slot->buffer) {
+            memcpy(slot->buffer, state, count);
+        }
+        return 0;
+    }
+
+    if (slot->count >= 0) {
+        ++slot->superseded;
+    }
+    slot->count = count;
+    socket->latest.batch[index] = slot->buffer;
+    slot->buffer = buf;
+
+    return 0;
+}
+
+int gudp_latest_read(struct gudp_socket * socket) {
+
+    struct sockaddr_in sa[GUDP_LATEST_BATCH];
+    struct iovec iov[GUDP_LATEST_BATCH];
+    struct mmsghdr msgs[GUDP_LATEST_BATCH];
+
+    socket->latest.nb_slots = 0;
+
+    unsigned int drained = 0;
+    int error = 0;
+    int result = 0;
+
+    while (drained < LATEST_DRAIN_MAX) {
+
+        unsigned int i;
+        for (i = 0; i < GUDP_LATEST_BATCH; ++i) {
+            iov[i].iov_base = socket->latest.batch[i];
+            iov[i].iov_len = GUDP_DATAGRAM_MAX;
+            memset(&msgs[i].msg_hdr, 0x00, sizeof(msgs[i].msg_hdr));
+            msgs[i].msg_hdr.msg_name = sa + i;
+            msgs[i].msg_hdr.msg_namelen = sizeof(*sa);
+            msgs[i].msg_hdr.msg_iov = iov + i;
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int ret = recvmmsg(socket->fd, msgs, GUDP_LATEST_BATCH, MSG_DONTWAIT, NULL);
+        if (ret < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                PRINT_ERROR_ERRNO("recvmmsg");
+                error = 1;
+            }
+            break;
+        }
+
+        for (i = 0; i < (unsigned int) ret; ++i) {
+            struct gudp_address address = { .ip = sa[i].sin_addr.s_addr, .port = ntohs(sa[i].sin_port) };
+            int status = keep(socket, i, msgs[i].msg_len, address);
+            if (status && result >= 0) {
+                result = status;
+            }
+        }
+
+        drained += ret;
+
+        if (ret < GUDP_LATEST_BATCH) {
+            break;
+        }
+    }
+
+    if (socket->latest.nb_slots == 0) {
+        if (error && result == 0) {
+            struct gudp_address address = { };
+            return socket->callbacks.fp_read(socket->user, NULL, -1, address);
+        }
+        return result;
+    }
+
+    unsigned int i;
+    for (i = 0; i < socket->latest.nb_slots; ++i) {
+        struct gudp_latest_slot * slot = socket->latest.slots + i;
+        socket->latest.superseded = slot->superseded;
+        int ret = gudp_read(socket, slot->buffer, slot->count, slot->address);
+        if (ret < 0) {
+            result = ret;
+            break;
+        }
+        if (ret && result >= 0) {
+            result = ret;
+        }
+    }
+
+    socket->latest.superseded = 0;
+    socket->latest.nb_slots = 0;
+
+    return result;
+}
+
+#endif
+
+int gudp_set_latest(struct gudp_socket * socket, int enable) {
+
+#ifndef WIN32
+    if (enable && socket->latest.batch[0] == NULL) {
+        unsigned int i;
+        for (i = 0; i < GUDP_LATEST_BATCH; ++i) {
+            socket->latest.batch[i] = malloc(GUDP_DATAGRAM_MAX);
+            if (socket->latest.batch[i] == NULL) {
+                PRINT_ERROR_ALLOC_FAILED("malloc");
+                gudp_latest_clean(socket);
+                return -1;
+            }
+        }
+    }
+
+    socket->latest.enabled = enable;
+
+    return 0;
+#else
+    (void) socket;
+    (void) enable;
+    PRINT_ERROR_OTHER("latest value mode is not supported on this platform");
+    return -1;
+#endif
+}
+
+unsigned int gudp_get_superseded(struct gudp_socket * socket) {
+
+    return socket->latest.superseded;
+}
+
+void gudp_latest_clean(struct gudp_socket * socket) {
+
+    unsigned int i;
+    for (i = 0; i < GUDP_LATEST_BATCH; ++i) {
+        free(socket->latest.batch[i]);
+        socket->latest.batch[i] = NULL;
+    }
+    for (i = 0; i < socket->latest.allocated; ++i) {
+        free(socket->latest.slots[i].buffer);
+    }
+    free(socket->latest.slots);
+    socket->latest.slots = NULL;
+    socket->latest.allocated = 0;
+    socket->latest.nb_slots = 0;
+    socket->latest.enabled = 0;
+}
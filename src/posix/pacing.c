@@ -0,0 +1,380 @@
+/*
+ Copyright (c) 2020 Mathieu Laurendeau <mat.lau@laposte.net>
+ License: GPLv3
+ */
+
+#include <src/gudp_internal.h>
+#ifndef WIN32
+#include <errno.h>
+#include <sys/socket.h>
+#ifdef SO_TXTIME
+#include <linux/net_tstamp.h>
+#endif
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <gimxcommon/include/gerror.h>
+
+#define PACING_QUEUE_MAX 4096 // maximum number of packets held in the release queue
+
+#ifndef WIN32
+
+static void bucket_init(struct gudp_bucket * bucket, const struct gudp_pacing * pacing) {
+
+    memset(bucket, 0x00, sizeof(*bucket));
+    bucket->rate = pacing->rate;
+    if (bucket->rate) {
+        bucket->tau = (uint64_t) pacing->burst * 1000000000ULL / bucket->rate;
+    }
+    bucket->stats.target_rate = pacing->rate;
+}
+
+static uint64_t bucket_release(const struct gudp_bucket * bucket, uint64_t now) {
+
+    if (bucket->tat > now + bucket->tau) {
+        return bucket->tat - bucket->tau;
+    }
+    return now;
+}
+
+static void bucket_consume(struct gudp_bucket * bucket, uint64_t release, unsigned int count) {
+
+    uint64_t start = bucket->tat > release ? bucket->tat : release;
+    bucket->tat = start + (uint64_t) count * 1000000000ULL / bucket->rate;
+}
+
+static void bucket_account(struct gudp_bucket * bucket, unsigned int count, uint64_t delay, uint64_t sent) {
+
+    if (bucket->stats.packets == 0) {
+        bucket->first = sent;
+        bucket->first_bytes = count;
+    }
+    bucket->last = sent;
+    ++bucket->stats.packets;
+    bucket->stats.bytes += count;
+    bucket->stats.last_delay = delay;
+    bucket->stats.total_delay += delay;
+    if (delay > bucket->stats.max_delay) {
+        bucket->stats.max_delay = delay;
+    }
+}
+
+static struct gudp_peer * paced_peer(struct gudp_socket * socket, struct gudp_address address) {
+
+    if (socket->pacing.nb_peers == 0) {
+        return NULL;
+    }
+    struct gudp_peer * peer = gudp_peer_get(socket, address, 0);
+    if (peer == NULL || peer->bucket.rate == 0) {
+        return NULL;
+    }
+    return peer;
+}
+
+static void account(struct gudp_socket * socket, struct gudp_address address, unsigned int count, uint64_t delay,
+        uint64_t sent) {
+
+    bucket_account(&socket->pacing.bucket, count, delay, sent);
+
+    struct gudp_peer * peer = paced_peer(socket, address);
+    if (peer != NULL) {
+        bucket_account(&peer->bucket, count, delay, sent);
+    }
+}
+
+static int arm_timer(struct gudp_socket * socket) {
+
+    return gudp_timer_arm(socket->pacing.timer, socket->pacing.head != NULL ? socket->pacing.head->release : 0);
+}
+
+static int flush(struct gudp_socket * socket, uint64_t now) {
+
+    struct gudp_paced_packet * packet = socket->pacing.head;
+    if (packet == NULL || packet->release > now) {
+        return 0;
+    }
+
+    while (packet != NULL && packet->release <= now) {
+        socket->pacing.head = packet->next;
+        --socket->pacing.queued;
+        if (gudp_sendto(socket, packet->data, packet->count, packet->address, 0) >= 0) {
+            account(socket, packet->address, packet->count, now - packet->queued, now);
+        }
+        free(packet);
+        packet = socket->pacing.head;
+    }
+
+    if (socket->pacing.head == NULL) {
+        socket->pacing.tail = NULL;
+    }
+
+    return arm_timer(socket);
+}
+
+static int timer_read(void * user) {
+
+    struct gudp_socket * socket = (struct gudp_socket *) user;
+
+    if (gudp_timer_read(socket->pacing.timer) < 0) {
+        return -1;
+    }
+
+    flush(socket, gudp_time_ns());
+
+    return 0;
+}
+
+static int enqueue(struct gudp_socket * socket, const void * buf, unsigned int count, struct gudp_address address,
+        uint64_t now, uint64_t release) {
+
+    if (socket->pacing.queued == PACING_QUEUE_MAX) {
+        PRINT_ERROR_OTHER("release queue is full");
+        return -1;
+    }
+
+    if (socket->pacing.timer < 0 && gudp_timer_open(socket, timer_read, &socket->pacing.timer) < 0) {
+        return -1;
+    }
+
+    struct gudp_paced_packet * packet = malloc(sizeof(*packet) + count);
+    if (packet == NULL) {
+        PRINT_ERROR_ALLOC_FAILED("malloc");
+        return -1;
+    }
+
+    packet->queued = now;
+    packet->release = release;
+    packet->address = address;
+    packet->count = count;
+    memcpy(packet->data, buf, count);
+
+    // keep the queue sorted by release time, and packets with the same release time in sending order
+    struct gudp_paced_packet ** prev = &socket->pacing.head;
+    if (socket->pacing.tail != NULL && socket->pacing.tail->release <= release) {
+        prev = &socket->pacing.tail->next;
+    } else {
+        while (*prev != NULL && (*prev)->release <= release) {
+            prev = &(*prev)->next;
+        }
+    }
+    packet->next = *prev;
+    *prev = packet;
+    if (packet->next == NULL) {
+        socket->pacing.tail = packet;
+    }
+    ++socket->pacing.queued;
+
+    if (socket->pacing.head == packet) {
+        return arm_timer(socket) < 0 ? -1 : (int) count;
+    }
+
+    return count;
+}
+
+int gudp_pacing_send(struct gudp_socket * socket, const void * buf, unsigned int count, struct gudp_address address) {
+
+    uint64_t now = gudp_time_ns();
+
+    flush(socket, now);
+
+    struct gudp_bucket * bucket = NULL;
+    if (socket->pacing.bucket.rate && socket->pacing.offload != GUDP_PACING_OFFLOAD_RATE) {
+        bucket = &socket->pacing.bucket;
+    }
+    struct gudp_peer * peer = paced_peer(socket, address);
+
+    uint64_t release = now;
+    if (bucket != NULL) {
+        release = bucket_release(bucket, now);
+    }
+    if (peer != NULL) {
+        uint64_t peer_release = bucket_release(&peer->bucket, now);
+        if (peer_release > release) {
+            release = peer_release;
+        }
+    }
+
+    if (release > now && socket->pacing.offload != GUDP_PACING_OFFLOAD_TXTIME) {
+        if (socket->callbacks.fp_register != NULL) {
+            int ret = enqueue(socket, buf, count, address, now, release);
+            if (ret >= 0) {
+                if (bucket != NULL) {
+                    bucket_consume(bucket, release, count);
+                }
+                if (peer != NULL) {
+                    bucket_consume(&peer->bucket, release, count);
+                }
+            }
+            return ret;
+        }
+        // not registered: wait until release time
+        struct timespec ts = { .tv_sec = release / 1000000000ULL, .tv_nsec = release % 1000000000ULL };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+            ;
+        }
+    }
+
+    uint64_t txtime = release > now ? release : 0;
+
+    int ret = gudp_sendto(socket, buf, count, address, txtime);
+    if (ret >= 0) {
+        if (bucket != NULL) {
+            bucket_consume(bucket, release, count);
+        }
+        if (peer != NULL) {
+            bucket_consume(&peer->bucket, release, count);
+        }
+        account(socket, address, count, release - now, release);
+    }
+
+    return ret;
+}
+
+/*
+ * Offload is an explicit choice: setsockopt succeeds whatever the egress qdisc is,
+ * so its success does not tell whether the kernel will actually pace.
+ */
+static int set_offload(struct gudp_socket * socket, const struct gudp_pacing * pacing) {
+
+    enum gudp_pacing_offload offload = pacing->rate ? pacing->offload : GUDP_PACING_OFFLOAD_NONE;
+
+    switch (offload) {
+    case GUDP_PACING_OFFLOAD_NONE:
+        break;
+    case GUDP_PACING_OFFLOAD_TXTIME:
+    {
+#ifdef SO_TXTIME
+        struct sock_txtime txtime = { .clockid = CLOCK_MONOTONIC, .flags = 0 };
+        if (setsockopt(socket->fd, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime)) < 0) {
+            PRINT_ERROR_ERRNO("setsockopt SO_TXTIME");
+            return -1;
+        }
+#else
+        PRINT_ERROR_OTHER("SO_TXTIME is not supported");
+        return -1;
+#endif
+        break;
+    }
+    case GUDP_PACING_OFFLOAD_RATE:
+    {
+#ifdef SO_MAX_PACING_RATE
+        unsigned int rate = pacing->rate < 0xFFFFFFFF ? pacing->rate : 0xFFFFFFFF;
+        if (setsockopt(socket->fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)) < 0) {
+            PRINT_ERROR_ERRNO("setsockopt SO_MAX_PACING_RATE");
+            return -1;
+        }
+#else
+        PRINT_ERROR_OTHER("SO_MAX_PACING_RATE is not supported");
+        return -1;
+#endif
+        break;
+    }
+    default:
+        PRINT_ERROR_OTHER("invalid offload");
+        return -1;
+    }
+
+#ifdef SO_MAX_PACING_RATE
+    if (socket->pacing.offload == GUDP_PACING_OFFLOAD_RATE && offload != GUDP_PACING_OFFLOAD_RATE) {
+        unsigned int rate = 0xFFFFFFFF;
+        if (setsockopt(socket->fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)) < 0) {
+            PRINT_ERROR_ERRNO("setsockopt SO_MAX_PACING_RATE");
+            return -1;
+        }
+    }
+#endif
+
+    socket->pacing.offload = offload;
+
+    return 0;
+}
+
+#else
+
+int gudp_pacing_send(struct gudp_socket * socket, const void * buf, unsigned int count, struct gudp_address address) {
+
+    return gudp_sendto(socket, buf, count, address, 0);
+}
+
+#endif
+
+int gudp_set_pacing(struct gudp_socket * socket, const struct gudp_address * address,
+        const struct gudp_pacing * pacing) {
+
+#ifndef WIN32
+    if (pacing == NULL) {
+        PRINT_ERROR_OTHER("pacing should not be NULL");
+        return -1;
+    }
+
+    if (address == NULL) {
+        if (set_offload(socket, pacing) < 0) {
+            return -1;
+        }
+        bucket_init(&socket->pacing.bucket, pacing);
+        socket->pacing.bucket.stats.offload = socket->pacing.offload;
+        return 0;
+    }
+
+    struct gudp_peer * peer = gudp_peer_get(socket, *address, pacing->rate != 0);
+    if (peer == NULL) {
+        return pacing->rate ? -1 : 0;
+    }
+
+    if (peer->bucket.rate && !pacing->rate) {
+        --socket->pacing.nb_peers;
+    } else if (!peer->bucket.rate && pacing->rate) {
+        ++socket->pacing.nb_peers;
+    }
+
+    bucket_init(&peer->bucket, pacing);
+    if (socket->pacing.offload == GUDP_PACING_OFFLOAD_TXTIME) {
+        peer->bucket.stats.offload = GUDP_PACING_OFFLOAD_TXTIME;
+    }
+
+    return 0;
+#else
+    (void) socket;
+    (void) address;
+    (void) pacing;
+    PRINT_ERROR_OTHER("pacing is not supported on this platform");
+    return -1;
+#endif
+}
+
+int gudp_get_pacing_stats(struct gudp_socket * socket, const struct gudp_address * address,
+        struct gudp_pacing_stats * stats) {
+
+    const struct gudp_bucket * bucket = &socket->pacing.bucket;
+
+    if (address != NULL) {
+        struct gudp_peer * peer = gudp_peer_get(socket, *address, 0);
+        if (peer == NULL || peer->bucket.rate == 0) {
+            PRINT_ERROR_OTHER("no pacing for this address");
+            return -1;
+        }
+        bucket = &peer->bucket;
+    }
+
+    *stats = bucket->stats;
+    if (bucket->last > bucket->first) {
+        stats->actual_rate = (bucket->stats.bytes - bucket->first_bytes) * 1000000000ULL / (bucket->last - bucket->first);
+    }
+
+    return 0;
+}
+
+void gudp_pacing_clean(struct gudp_socket * socket) {
+
+#ifndef WIN32
+    gudp_timer_close(socket, &socket->pacing.timer);
+#endif
+
+    while (socket->pacing.head != NULL) {
+        struct gudp_paced_packet * next = socket->pacing.head->next;
+        free(socket->pacing.head);
+        socket->pacing.head = next;
+    }
+    socket->pacing.tail = NULL;
+    socket->pacing.queued = 0;
+}
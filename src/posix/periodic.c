@@ -0,0 +1,170 @@
+/*
+ Copyright (c) 2020 Mathieu Laurendeau <mat.lau@laposte.net>
+ License: GPLv3
+ */
+
+#include <src/gudp_internal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gimxcommon/include/gerror.h>
+
+#ifndef WIN32
+
+static inline void relax() {
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static void record(struct gudp_periodic_stats * stats, uint64_t error) {
+
+    ++stats->sends;
+    stats->total_error += error;
+    if (error > stats->max_error) {
+        stats->max_error = error;
+    }
+    unsigned int bucket = error < 2 ? 0 : 63 - __builtin_clzll(error);
+    if (bucket >= GUDP_PERIODIC_HISTOGRAM) {
+        bucket = GUDP_PERIODIC_HISTOGRAM - 1;
+    }
+    ++stats->histogram[bucket];
+}
+
+static int arm_timer(struct gudp_socket * socket) {
+
+    uint64_t wakeup = 0;
+    if (socket->periodic.config.fp_produce != NULL) {
+        wakeup = socket->periodic.deadline - socket->periodic.config.spin;
+    }
+    return gudp_timer_arm(socket->periodic.timer, wakeup);
+}
+
+static int timer_read(void * user) {
+
+    struct gudp_socket * socket = (struct gudp_socket *) user;
+
+    if (gudp_timer_read(socket->periodic.timer) < 0) {
+        return -1;
+    }
+
+    const struct gudp_periodic * config = &socket->periodic.config;
+    if (config->fp_produce == NULL) {
+        return 0;
+    }
+
+    uint64_t now = gudp_time_ns();
+
+    // do not send a burst after a stall
+    if (now >= socket->periodic.deadline + config->period) {
+        uint64_t skipped = (now - socket->periodic.deadline) / config->period;
+        socket->periodic.stats.missed += skipped;
+        socket->periodic.deadline += skipped * config->period;
+    }
+
+    // produce the payload before spinning, so that producing it does not delay the send
+    uint64_t deadline = socket->periodic.deadline;
+    int length = config->fp_produce(config->user, socket->periodic.buffer, config->size);
+    if (config->fp_produce == NULL || socket->periodic.buffer == NULL || socket->periodic.deadline != deadline) {
+        // the producer stopped or restarted the periodic sender
+        return 0;
+    }
+    if (length < 0) {
+        socket->periodic.config.fp_produce = NULL;
+        return arm_timer(socket);
+    }
+    if ((unsigned int) length > config->size) {
+        PRINT_ERROR_OTHER("the produced payload is larger than the buffer");
+        ++socket->periodic.stats.failed;
+        socket->periodic.deadline += config->period;
+        return arm_timer(socket);
+    }
+
+    uint64_t start = gudp_time_ns();
+    while ((now = gudp_time_ns()) < socket->periodic.deadline) {
+        relax();
+    }
+    socket->periodic.stats.spin += now - start;
+
+    if (length > 0) {
+        if (gudp_send(socket, socket->periodic.buffer, length, config->address) < 0) {
+            ++socket->periodic.stats.failed;
+        } else {
+            record(&socket->periodic.stats, now - socket->periodic.deadline);
+        }
+    }
+
+    socket->periodic.deadline += config->period;
+
+    return arm_timer(socket);
+}
+
+#endif
+
+int gudp_periodic_start(struct gudp_socket * socket, const struct gudp_periodic * periodic) {
+
+#ifndef WIN32
+    if (periodic == NULL || periodic->fp_produce == NULL || periodic->period == 0) {
+        PRINT_ERROR_OTHER("a producer and a period are required");
+        return -1;
+    }
+
+    if (!periodic->address.ip || !periodic->address.port) {
+        PRINT_ERROR_OTHER("ip and port should not be 0");
+        return -1;
+    }
+
+    if (socket->callbacks.fp_register == NULL) {
+        PRINT_ERROR_OTHER("the socket is not registered");
+        return -1;
+    }
+
+    unsigned int size = periodic->size ? periodic->size : GUDP_DATAGRAM_MAX;
+    if (socket->periodic.buffer == NULL || size != socket->periodic.config.size) {
+        void * ptr = realloc(socket->periodic.buffer, size);
+        if (ptr == NULL) {
+            PRINT_ERROR_ALLOC_FAILED("realloc");
+            return -1;
+        }
+        socket->periodic.buffer = ptr;
+    }
+
+    if (socket->periodic.timer < 0 && gudp_timer_open(socket, timer_read, &socket->periodic.timer) < 0) {
+        return -1;
+    }
+
+    socket->periodic.config = *periodic;
+    socket->periodic.config.size = size;
+    if (socket->periodic.config.spin > periodic->period) {
+        socket->periodic.config.spin = periodic->period;
+    }
+    memset(&socket->periodic.stats, 0x00, sizeof(socket->periodic.stats));
+    socket->periodic.deadline = gudp_time_ns() + periodic->period;
+
+    return arm_timer(socket);
+#else
+    (void) socket;
+    (void) periodic;
+    PRINT_ERROR_OTHER("periodic sending is not supported on this platform");
+    return -1;
+#endif
+}
+
+int gudp_periodic_stop(struct gudp_socket * socket) {
+
+#ifndef WIN32
+    gudp_timer_close(socket, &socket->periodic.timer);
+#endif
+
+    socket->periodic.config.fp_produce = NULL;
+    free(socket->periodic.buffer);
+    socket->periodic.buffer = NULL;
+
+    return 0;
+}
+
+int gudp_get_periodic_stats(struct gudp_socket * socket, struct gudp_periodic_stats * stats) {
+
+    *stats = socket->periodic.stats;
+
+    return 0;
+}
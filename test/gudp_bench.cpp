@@ -0,0 +1,261 @@
+/*
+ Copyright (c) 2020 Mathieu Laurendeau <mat.lau@laposte.net>
+ License: GPLv3
+ */
+
+/*
+ * Compare the round-trip cost of the raw C callbacks with the C++ coroutine layer.
+ * Both clients ping the same echo server over loopback, from the same gpoll loop.
+ * After a warm-up, runs of both clients alternate, and the medians are compared.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <getopt.h>
+
+#include <gimxudp/include/gudp.hpp>
+extern "C" {
+#include <gimxpoll/include/gpoll.h>
+#include <gimxtime/include/gtime.h>
+#include <gimxprio/include/gprio.h>
+}
+
+static int prio = 0;
+
+static char *src = NULL;
+
+#define WARMUP_DIVIDER 10 // warm-up runs use samples / WARMUP_DIVIDER round trips
+
+static unsigned int samples = 0;
+static unsigned short packet_size = 0;
+static unsigned int runs = 5;
+static double tolerance = 5; // percent
+
+static unsigned int target = 0; // number of round trips of the current run
+
+static struct gudp_address srvaddress;
+
+static std::vector<std::byte> packet;
+
+static unsigned int count = 0;
+static int done = 0;
+
+static void usage() {
+    fprintf(stderr, "Usage: ./gudp_bench -i ip:port -n samples -s packet size [-r runs] [-t tolerance %%] [-h]\n");
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Reads command-line arguments.
+ */
+static int read_args(int argc, char *argv[]) {
+
+    int opt;
+    while ((opt = getopt(argc, argv, "hi:n:r:s:t:")) != -1) {
+        switch (opt) {
+        case 'h':
+            prio = 1;
+            break;
+        case 'i':
+            src = optarg;
+            break;
+        case 'n':
+            samples = atoi(optarg);
+            break;
+        case 'r':
+            runs = atoi(optarg);
+            break;
+        case 's':
+            packet_size = atoi(optarg);
+            break;
+        case 't':
+            tolerance = atof(optarg);
+            break;
+        default: /* '?' */
+            usage();
+            break;
+        }
+    }
+    return 0;
+}
+
+static struct gudp_socket *server = NULL;
+static struct gudp_socket *client = NULL;
+
+static int server_read(void *user __attribute__((unused)), const void *buf, int status, struct gudp_address address) {
+
+    if (status < 0) {
+        done = 1;
+        return 1;
+    }
+    gudp_send(server, buf, status, address);
+    return 0;
+}
+
+static int client_read(void *user __attribute__((unused)), const void *buf __attribute__((unused)), int status,
+        struct gudp_address address __attribute__((unused))) {
+
+    if (status < 0 || ++count == target) {
+        done = 1;
+        return 1;
+    }
+    gudp_send(client, packet.data(), packet.size(), srvaddress);
+    return 0;
+}
+
+static int close_callback(void *user __attribute__((unused))) {
+    done = 1;
+    return 1;
+}
+
+static gudp::task ping(gudp::socket &sock) {
+
+    for (count = 0; count < target; ++count) {
+        if (co_await sock.send(packet, srvaddress) < 0) {
+            break;
+        }
+        gudp::datagram dg = co_await sock.recv();
+        if (dg.status < 0) {
+            break;
+        }
+    }
+    done = 1;
+    sock.interrupt();
+}
+
+static gtime median(std::vector<gtime> values) {
+
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+static gtime run_c(unsigned int n) {
+
+    client = gudp_open(GUDP_MODE_CLIENT, srvaddress);
+    if (client == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    GUDP_CALLBACKS callbacks = {
+            .fp_read = client_read,
+            .fp_close = close_callback,
+            .fp_register = gpoll_register_fd,
+            .fp_remove = gpoll_remove_fd,
+    };
+    gudp_register(client, NULL, &callbacks);
+
+    target = n;
+    count = 0;
+    done = 0;
+
+    gtime t0 = gtime_gettime();
+
+    gudp_send(client, packet.data(), packet.size(), srvaddress);
+
+    while (!done) {
+        gpoll();
+    }
+
+    gtime t1 = gtime_gettime();
+
+    gudp_close(client);
+
+    return (t1 - t0) / n;
+}
+
+static gtime run_cpp(unsigned int n) {
+
+    gudp::socket sock(GUDP_MODE_CLIENT, srvaddress);
+    sock.attach(gpoll_register_fd, gpoll_remove_fd);
+
+    target = n;
+    done = 0;
+
+    gtime t0 = gtime_gettime();
+
+    ping(sock);
+
+    while (!done) {
+        gpoll();
+    }
+
+    return (gtime_gettime() - t0) / n;
+}
+
+int main(int argc, char *argv[]) {
+
+    read_args(argc, argv);
+
+    if (src == NULL || samples == 0 || packet_size == 0 || runs == 0) {
+        usage();
+        return -1;
+    }
+
+    if (gudp_parse_address(src, &srvaddress)) {
+        fprintf(stderr, "failed to parse address\n");
+        return -1;
+    }
+
+    packet.resize(packet_size);
+
+    server = gudp_open(GUDP_MODE_SERVER, srvaddress);
+    if (server == NULL) {
+        return -1;
+    }
+
+    GUDP_CALLBACKS callbacks = {
+            .fp_read = server_read,
+            .fp_close = close_callback,
+            .fp_register = gpoll_register_fd,
+            .fp_remove = gpoll_remove_fd,
+    };
+    gudp_register(server, NULL, &callbacks);
+
+    if (prio && gprio_init() < 0) {
+        return -1;
+    }
+
+    // warm up caches, branch predictors and the loopback path
+    unsigned int warmup = samples / WARMUP_DIVIDER ? samples / WARMUP_DIVIDER : 1;
+    run_c(warmup);
+    run_cpp(warmup);
+
+    std::vector<gtime> c, cpp;
+
+    printf("run\tc (ns)\tc++ (ns)\n");
+
+    unsigned int i;
+    for (i = 0; i < runs; ++i) {
+        // alternate which path runs first
+        if (i % 2) {
+            cpp.push_back(run_cpp(samples));
+            c.push_back(run_c(samples));
+        } else {
+            c.push_back(run_c(samples));
+            cpp.push_back(run_cpp(samples));
+        }
+        printf("%u\t" GTIME_FS "\t" GTIME_FS "\n", i, c.back(), cpp.back());
+    }
+
+    if (prio) {
+        gprio_clean();
+    }
+
+    gudp_close(server);
+
+    gtime c_median = median(c);
+    gtime cpp_median = median(cpp);
+    double ratio = (double) cpp_median / c_median;
+
+    printf("median\t" GTIME_FS "\t" GTIME_FS "\n", c_median, cpp_median);
+    printf("c++/c\t%.3f\n", ratio);
+
+    if (ratio > 1 + tolerance / 100) {
+        fprintf(stderr, "c++ is slower than c by more than %.1f%%\n", tolerance);
+        return 1;
+    }
+
+    return 0;
+}
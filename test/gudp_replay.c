@@ -0,0 +1,213 @@
+/*
+ Copyright (c) 2020 Mathieu Laurendeau <mat.lau@laposte.net>
+ License: GPLv3
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include <gimxudp/include/gudp.h>
+#include <gimxtime/include/gtime.h>
+#include <gimxprio/include/gprio.h>
+#include <gimxlog/include/glog.h>
+
+#include <gimxcommon/test/common.h>
+#include <gimxcommon/test/handlers.c>
+
+#define SPIN_THRESHOLD 1000000 // nanoseconds, sleep until the deadline is closer than this, then spin
+
+static int debug = 0;
+static int prio = 0;
+
+static char *file = NULL;
+static char *dst = NULL;
+
+static struct gudp_address dstaddress;
+
+static double speed = 1;
+static enum gudp_direction direction = GUDP_DIRECTION_OUT;
+
+static unsigned int verbose = 0;
+
+static struct gudp_capture_record **records = NULL;
+static unsigned int count = 0;
+static unsigned int allocated = 0;
+
+static void usage() {
+    fprintf(stderr, "Usage: ./gudp_replay -f capture [-o ip:port] [-x speed] [-r] -v -g\n");
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Reads command-line arguments.
+ */
+static int read_args(int argc, char *argv[]) {
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:gho:rvx:")) != -1) {
+        switch (opt) {
+        case 'f':
+            file = optarg;
+            break;
+        case 'g':
+            debug = 1;
+            break;
+        case 'h':
+            prio = 1;
+            break;
+        case 'o':
+            dst = optarg;
+            break;
+        case 'r':
+            direction = GUDP_DIRECTION_IN;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'x':
+            speed = atof(optarg);
+            break;
+        default: /* '?' */
+            usage();
+            break;
+        }
+    }
+    return 0;
+}
+
+static int record_callback(void *user __attribute__((unused)), const struct gudp_capture_record *record) {
+
+    if (record->direction != direction) {
+        return 0;
+    }
+
+    if (count == allocated) {
+        unsigned int size = allocated ? 2 * allocated : 1024;
+        void *ptr = realloc(records, size * sizeof(*records));
+        if (ptr == NULL) {
+            fprintf(stderr, "realloc failed\n");
+            return 1;
+        }
+        records = ptr;
+        allocated = size;
+    }
+
+    struct gudp_capture_record *copy = malloc(record->length);
+    if (copy == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        return 1;
+    }
+    memcpy(copy, record, record->length);
+    records[count++] = copy;
+
+    return 0;
+}
+
+static void wait_until(gtime deadline) {
+
+    gtime now = gtime_gettime();
+    if (now + SPIN_THRESHOLD < deadline) {
+        usleep((deadline - now - SPIN_THRESHOLD) / 1000);
+    }
+    while (gtime_gettime() < deadline) {
+        ;
+    }
+}
+
+int main(int argc, char *argv[]) {
+
+    setup_handlers();
+
+    read_args(argc, argv);
+
+    if (debug) {
+        glog_set_all_levels(E_GLOG_LEVEL_DEBUG);
+    }
+
+    if (file == NULL || speed <= 0 || (direction == GUDP_DIRECTION_IN && dst == NULL)) {
+        usage();
+        return -1;
+    }
+
+    if (gudp_capture_read(file, NULL, record_callback) < 0) {
+        return -1;
+    }
+
+    struct gudp_socket *s = NULL;
+
+    if (dst) {
+        if (gudp_parse_address(dst, &dstaddress)) {
+            fprintf(stderr, "failed to parse address\n");
+            return -1;
+        }
+        s = gudp_open(GUDP_MODE_CLIENT, dstaddress);
+    } else {
+        struct gudp_address any = { .ip = 0, .port = 0 };
+        s = gudp_open(GUDP_MODE_SERVER, any);
+    }
+    if (s == NULL) {
+        return -1;
+    }
+
+    if (prio && gprio_init() < 0) {
+        set_done();
+    }
+
+    gtime worst = 0;
+    gtime sum = 0;
+    unsigned int sent = 0;
+
+    gtime start = gtime_gettime();
+
+    unsigned int i;
+    for (i = 0; i < count && !is_done(); ++i) {
+
+        const struct gudp_capture_record *record = records[i];
+
+        gtime deadline = start + (record->timestamp - records[0]->timestamp) / speed;
+
+        wait_until(deadline);
+
+        gtime late = gtime_gettime() - deadline;
+
+        struct gudp_address address = { .ip = record->ip, .port = record->port };
+        if (dst) {
+            address = dstaddress;
+        }
+
+        if (gudp_send(s, record->data, record->count, address) < 0) {
+            set_done();
+            break;
+        }
+
+        sum += late;
+        if (late > worst) {
+            worst = late;
+        }
+        ++sent;
+    }
+
+    if (prio) {
+        gprio_clean();
+    }
+
+    gudp_close(s);
+
+    if (verbose) {
+        printf("packets: %u speed: %g\n", sent, speed);
+        printf("worst\tavg\n");
+    }
+    if (sent > 0) {
+        printf(""GTIME_FS"\t"GTIME_FS"\n", GTIME_USEC(worst), GTIME_USEC(sum / sent));
+    }
+
+    for (i = 0; i < count; ++i) {
+        free(records[i]);
+    }
+    free(records);
+
+    return 0;
+}
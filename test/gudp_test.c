@@ -9,6 +9,7 @@
 #include <string.h>
 #include <math.h>
 #include <getopt.h>
+#include <unistd.h>
 
 #include <gimxudp/include/gudp.h>
 #include <gimxpoll/include/gpoll.h>
@@ -23,11 +24,18 @@
 
 #define PERIOD 10000//microseconds
 
+#define CAPTURE_SIZE (16 * 1024 * 1024)
+
+#define PROBE_PERIODS 10 // send a clock probe every PROBE_PERIODS periods
+
 static int debug = 0;
 static int prio = 0;
 
 static char *src = NULL;
 static char *dst = NULL;
+static char *capture = NULL;
+static char *impairment = NULL;
+static char *pacing = NULL;
 
 static struct gudp_address srcaddress;
 static struct gudp_address dstaddress;
@@ -42,6 +50,19 @@ static unsigned int samples = 0;
 static unsigned short packet_size = 0;
 
 static unsigned int verbose = 0;
+static unsigned int probe = 0;
+static unsigned int delta = 0;
+static unsigned int changed = 0; // number of bytes changed per packet, 0 to change all of them
+static unsigned int offset = 0;
+static unsigned int max_message = 0;
+static unsigned int period = 0;
+static unsigned int spin = 0;
+static int pending = 0; // a periodic packet was not echoed yet
+static int stream = 0; // send every period, even if the previous packet was not echoed yet
+static int latest = -1; // server processing delay in latest value mode (microseconds)
+static unsigned long long received = 0;
+static unsigned long long superseded = 0;
+static unsigned long long stale = 0;
 
 static unsigned int duration = 0;
 static unsigned int allocated = 1024; // default allocation when duration is used
@@ -89,21 +110,114 @@ void results(gtime *tdiff, unsigned int cpt) {
 }
 
 static void usage() {
-    fprintf(stderr, "Usage: ./gudp_test [-i ip:port] [-o ip:port] [-d duration] [-n samples] [-s packet size] -v -g\n");
+    fprintf(stderr, "Usage: ./gudp_test [-i ip:port] [-o ip:port] [-d duration] [-n samples] [-s packet size] [-c capture] [-e keyframe interval] [-b changed bytes] [-m max message size] [-l impairment] [-p pacing] [-t period] [-w spin] [-a processing delay] -f -k -v -g\n");
     exit(EXIT_FAILURE);
 }
 
+/*
+ * Parses impairment settings, e.g. "seed=1,loss=0.01,delay=500,jitter=100".
+ */
+static int parse_impairment(char *spec, struct gudp_impairment *impairment) {
+
+    memset(impairment, 0x00, sizeof(*impairment));
+
+    char *token;
+    for (token = strtok(spec, ","); token != NULL; token = strtok(NULL, ",")) {
+        char *value = strchr(token, '=');
+        if (value == NULL) {
+            return -1;
+        }
+        *(value++) = '\0';
+        if (!strcmp(token, "seed")) {
+            impairment->seed = strtoull(value, NULL, 0);
+        } else if (!strcmp(token, "loss")) {
+            impairment->loss = atof(value);
+        } else if (!strcmp(token, "burst_enter")) {
+            impairment->burst_enter = atof(value);
+        } else if (!strcmp(token, "burst_exit")) {
+            impairment->burst_exit = atof(value);
+        } else if (!strcmp(token, "burst_loss")) {
+            impairment->burst_loss = atof(value);
+        } else if (!strcmp(token, "delay")) {
+            impairment->delay = atoi(value);
+        } else if (!strcmp(token, "jitter")) {
+            impairment->jitter = atoi(value);
+        } else if (!strcmp(token, "reorder")) {
+            impairment->reorder = atof(value);
+        } else if (!strcmp(token, "duplicate")) {
+            impairment->duplicate = atof(value);
+        } else if (!strcmp(token, "rate")) {
+            impairment->rate = strtoull(value, NULL, 0);
+        } else {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Parses pacing settings, e.g. "rate=1000000,burst=4,offload=none".
+ */
+static int parse_pacing(char *spec, struct gudp_pacing *pacing) {
+
+    memset(pacing, 0x00, sizeof(*pacing));
+
+    char *token;
+    for (token = strtok(spec, ","); token != NULL; token = strtok(NULL, ",")) {
+        char *value = strchr(token, '=');
+        if (value == NULL) {
+            return -1;
+        }
+        *(value++) = '\0';
+        if (!strcmp(token, "rate")) {
+            pacing->rate = strtoull(value, NULL, 0);
+        } else if (!strcmp(token, "burst")) {
+            pacing->burst = atoi(value);
+        } else if (!strcmp(token, "offload")) {
+            if (!strcmp(value, "none")) {
+                pacing->offload = GUDP_PACING_OFFLOAD_NONE;
+            } else if (!strcmp(value, "txtime")) {
+                pacing->offload = GUDP_PACING_OFFLOAD_TXTIME;
+            } else if (!strcmp(value, "rate")) {
+                pacing->offload = GUDP_PACING_OFFLOAD_RATE;
+            } else {
+                return -1;
+            }
+        } else {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 /*
  * Reads command-line arguments.
  */
 static int read_args(int argc, char *argv[]) {
 
     int opt;
-    while ((opt = getopt(argc, argv, "d:ghi:n:o:s:v")) != -1) {
+    while ((opt = getopt(argc, argv, "a:b:c:d:e:fghi:kl:m:n:o:p:s:t:vw:")) != -1) {
         switch (opt) {
+        case 'a':
+            latest = atoi(optarg);
+            break;
+        case 'b':
+            changed = atoi(optarg);
+            break;
+        case 'c':
+            capture = optarg;
+            break;
         case 'd':
             duration = atoi(optarg) * 1000000UL / PERIOD;
             break;
+        case 'e':
+            delta = atoi(optarg);
+            break;
+        case 'f':
+            stream = 1;
+            break;
         case 'g':
             debug = 1;
             break;
@@ -113,18 +227,36 @@ static int read_args(int argc, char *argv[]) {
         case 'i':
             src = optarg;
             break;
+        case 'k':
+            probe = 1;
+            break;
+        case 'l':
+            impairment = optarg;
+            break;
+        case 'm':
+            max_message = atoi(optarg);
+            break;
         case 'n':
             samples = atoi(optarg);
             break;
         case 'o':
             dst = optarg;
             break;
+        case 'p':
+            pacing = optarg;
+            break;
         case 's':
             packet_size = atoi(optarg);
             break;
+        case 't':
+            period = atoi(optarg);
+            break;
         case 'v':
             verbose = 1;
             break;
+        case 'w':
+            spin = atoi(optarg);
+            break;
         default: /* '?' */
             usage();
             break;
@@ -133,6 +265,26 @@ static int read_args(int argc, char *argv[]) {
     return 0;
 }
 
+/*
+ * Change the packet content: all bytes, or only a few ones, which makes delta encoding worth it.
+ */
+static void next_packet() {
+
+    if (changed == 0 || changed >= packet_size) {
+        unsigned int i;
+        for (i = 0; i < packet_size; ++i) {
+            packet[i]++;
+        }
+        return;
+    }
+
+    unsigned int i;
+    for (i = 0; i < changed; ++i) {
+        packet[offset]++;
+        offset = (offset + 1) % packet_size;
+    }
+}
+
 int read_callback(void *user __attribute__((unused)), const void *buf, int status,
         struct gudp_address address) {
 
@@ -145,6 +297,14 @@ int read_callback(void *user __attribute__((unused)), const void *buf, int statu
 
     if (src != NULL) {
 
+        ++received;
+        superseded += gudp_get_superseded(s);
+
+        if (latest > 0) {
+            // simulate a slow consumer, so that datagrams pile up in the receive queue
+            usleep(latest);
+        }
+
         ret = gudp_send(s, buf, status, address);
         if (status < 0) {
             set_done();
@@ -156,6 +316,15 @@ int read_callback(void *user __attribute__((unused)), const void *buf, int statu
 
         t1 = gtime_gettime();
 
+        if (stream && memcmp(result, packet, packet_size)) {
+
+            // echo of a packet that was already replaced by a newer one
+            ++stale;
+            return 0;
+        }
+
+        pending = 0;
+
         if (memcmp(result, packet, packet_size)) {
 
             fprintf(stderr, "bad packet content\n");
@@ -164,10 +333,7 @@ int read_callback(void *user __attribute__((unused)), const void *buf, int statu
 
         } else {
 
-            unsigned int i;
-            for (i = 0; i < packet_size; ++i) {
-                packet[i]++;
-            }
+            next_packet();
 
             if (samples == 0 && count == allocated) {
                 void *ptr = realloc(tRead, 2 * allocated * sizeof(*tRead));
@@ -194,7 +360,7 @@ int read_callback(void *user __attribute__((unused)), const void *buf, int statu
 
                     set_done();
 
-                } else {
+                } else if (period == 0) {
 
                     t0 = gtime_gettime();
 
@@ -214,6 +380,30 @@ int read_callback(void *user __attribute__((unused)), const void *buf, int statu
     return ret;
 }
 
+int produce_callback(void *user __attribute__((unused)), void *buf, unsigned int size __attribute__((unused))) {
+
+    if (is_done()) {
+        return -1;
+    }
+
+    if (pending) {
+        if (!stream) {
+            // skip this period
+            return 0;
+        }
+        // replace the packet that was not echoed yet
+        next_packet();
+    }
+
+    memcpy(buf, packet, packet_size);
+
+    pending = 1;
+
+    t0 = gtime_gettime();
+
+    return packet_size;
+}
+
 int close_callback(void *user __attribute__((unused))) {
     set_done();
     return 1;
@@ -278,6 +468,45 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if (capture != NULL && gudp_capture_start(s, capture, CAPTURE_SIZE) < 0) {
+        return -1;
+    }
+
+    if (latest >= 0 && mode == GUDP_MODE_SERVER && gudp_set_latest(s, 1) < 0) {
+        return -1;
+    }
+
+    if (delta && gudp_set_delta(s, NULL, delta) < 0) {
+        return -1;
+    }
+
+    struct gudp_fragmentation fragmentation = { .max_message = max_message };
+    if (max_message && gudp_set_fragmentation(s, &fragmentation) < 0) {
+        return -1;
+    }
+
+    if (impairment != NULL) {
+        struct gudp_impairment settings;
+        if (parse_impairment(impairment, &settings) < 0) {
+            fprintf(stderr, "failed to parse impairment\n");
+            return -1;
+        }
+        if (gudp_set_impairment(s, GUDP_DIRECTION_OUT, &settings) < 0) {
+            return -1;
+        }
+    }
+
+    if (pacing != NULL) {
+        struct gudp_pacing settings;
+        if (parse_pacing(pacing, &settings) < 0) {
+            fprintf(stderr, "failed to parse pacing\n");
+            return -1;
+        }
+        if (gudp_set_pacing(s, NULL, &settings) < 0) {
+            return -1;
+        }
+    }
+
     GUDP_CALLBACKS callbacks = {
             .fp_read = read_callback,
             .fp_close = close_callback,
@@ -286,9 +515,25 @@ int main(int argc, char *argv[]) {
     };
     gudp_register(s, NULL, &callbacks);
 
+    if (mode == GUDP_MODE_SERVER) {
+        // answer clock probes
+        gudp_clock_enable(s, 1);
+    }
+
     t0 = gtime_gettime();
 
-    if (mode == GUDP_MODE_CLIENT) {
+    if (mode == GUDP_MODE_CLIENT && period) {
+        struct gudp_periodic periodic = {
+                .period = period * 1000ULL,
+                .spin = spin * 1000ULL,
+                .size = packet_size,
+                .address = dstaddress,
+                .fp_produce = produce_callback,
+        };
+        if (gudp_periodic_start(s, &periodic) < 0) {
+            set_done();
+        }
+    } else if (mode == GUDP_MODE_CLIENT) {
         int ret = gudp_send(s, packet, packet_size, dstaddress);
         if (ret < 0) {
             set_done();
@@ -307,6 +552,27 @@ int main(int argc, char *argv[]) {
         if (duration > 0 && period_count >= duration) {
             set_done();
         }
+        if (probe && mode == GUDP_MODE_CLIENT && period_count % PROBE_PERIODS == 1) {
+            gudp_clock_probe(s, dstaddress);
+        }
+    }
+
+    struct gudp_one_way one_way;
+    int one_way_status = -1;
+    if (probe && mode == GUDP_MODE_CLIENT) {
+        one_way_status = gudp_estimate_one_way(s, dstaddress, &one_way);
+    }
+
+    struct gudp_periodic_stats periodic_stats;
+    int periodic_status = -1;
+    if (period && mode == GUDP_MODE_CLIENT) {
+        periodic_status = gudp_get_periodic_stats(s, &periodic_stats);
+    }
+
+    struct gudp_pacing_stats pacing_stats;
+    int pacing_status = -1;
+    if (pacing != NULL) {
+        pacing_status = gudp_get_pacing_stats(s, NULL, &pacing_stats);
     }
 
     if (prio) {
@@ -319,14 +585,57 @@ int main(int argc, char *argv[]) {
 
     gudp_close(s);
 
+    if (mode == GUDP_MODE_SERVER && latest >= 0) {
+        if (verbose) {
+            printf("received\tsuperseded\n");
+        }
+        printf("%llu\t%llu\n", received, superseded);
+    }
+
     if (mode == GUDP_MODE_CLIENT) {
         if (verbose) {
+            if (stream) {
+                printf("stale echoes: %llu ", stale);
+            }
             printf("samples: %d ", count);
             printf("packet size: %d\n", packet_size);
             printf("worst\tavg\tstdev\n");
         }
         results(tRead, count);
         printf("\n");
+        if (one_way_status == 0) {
+            if (verbose) {
+                printf("clock samples: %u drift: %.1f ns/s\n", one_way.samples, one_way.drift);
+                printf("offset\trtt\tforward\tbackward\n");
+            }
+            printf("%lld\t"GTIME_FS"\t%lld\t%lld\n", (long long) one_way.offset / 1000, GTIME_USEC((gtime) one_way.rtt),
+                    (long long) one_way.forward / 1000, (long long) one_way.backward / 1000);
+        }
+        if (periodic_status == 0) {
+            if (verbose) {
+                printf("sends: %llu failed: %llu missed: %llu spin: %llu us\n", (unsigned long long) periodic_stats.sends,
+                        (unsigned long long) periodic_stats.failed, (unsigned long long) periodic_stats.missed,
+                        (unsigned long long) periodic_stats.spin / 1000);
+                printf("send error (ns)\tsends\n");
+            }
+            unsigned int i;
+            for (i = 0; i < GUDP_PERIODIC_HISTOGRAM; ++i) {
+                if (periodic_stats.histogram[i]) {
+                    printf("%llu\t%llu\n", i ? 1ULL << i : 0ULL, (unsigned long long) periodic_stats.histogram[i]);
+                }
+            }
+        }
+    }
+
+    if (pacing_status == 0) {
+        if (verbose) {
+            printf("paced packets: %llu bytes: %llu\n", (unsigned long long) pacing_stats.packets,
+                    (unsigned long long) pacing_stats.bytes);
+            printf("target (B/s)\tactual (B/s)\tmax delay (us)\tavg delay (us)\n");
+        }
+        printf("%llu\t%llu\t%llu\t%llu\n", (unsigned long long) pacing_stats.target_rate,
+                (unsigned long long) pacing_stats.actual_rate, (unsigned long long) pacing_stats.max_delay / 1000,
+                (unsigned long long) (pacing_stats.packets ? pacing_stats.total_delay / pacing_stats.packets / 1000 : 0));
     }
 
     free(packet);